@@ -36,8 +36,25 @@ typedef char TCHAR;
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#ifndef __FreeBSD__
+#include <sys/ioctl.h>
+#endif
 #endif /* #ifndef __KERNEL__ */
 
+/**
+ * struct bbapi_mode - optional request attributes, bbapi_struct::pMode points here
+ * @nDeadline: absolute CLOCK_MONOTONIC time in nanoseconds, a request still
+ *             waiting for the BIOS at that time fails with ETIMEDOUT;
+ *             0 means no deadline
+ * @nFlags: reserved, has to be 0
+ * @nReserved: reserved, has to be 0
+ */
+struct bbapi_mode {
+	uint64_t nDeadline;
+	uint32_t nFlags;
+	uint32_t nReserved;
+};
+
 struct bbapi_struct {
 	uint32_t nIndexGroup;
 	uint32_t nIndexOffset;
@@ -64,6 +81,88 @@ struct bbapi_struct {
 	{};
 #endif /* #ifdef __cplusplus */
 };
+
+#define BBAPI_UEEPROM_SIZE 128 // size of the user EEPROM area, see BIOSIOFFS_UEEPROM_WRITE
+
+/**
+ * struct bbapi_persist - blob the driver writes to the user EEPROM on power fail
+ * @nSize: number of valid bytes in @data, 0 disarms the power fail write
+ * @nReserved: reserved, has to be 0
+ * @data: the blob, padded with zeros to BBAPI_UEEPROM_SIZE when written
+ */
+struct bbapi_persist {
+	uint32_t nSize;
+	uint32_t nReserved;
+	uint8_t data[BBAPI_UEEPROM_SIZE];
+};
+
+#define BBAPI_CMD_PERSIST _IOW('B', 0x08, struct bbapi_persist)	// arm the power fail write to the user EEPROM
+
+#define BBAPI_V2_PAYLOAD_SIZE 256 // maximum payload of struct bbapi_struct_v2, equals BBAPI_BUFFER_SIZE
+
+/**
+ * struct bbapi_struct_v2 - BIOS call with inline payload
+ * @nIndexGroup: IndexGroup
+ * @nIndexOffset: IndexOffset
+ * @nInBufferSize: number of input bytes in @data
+ * @nOutBufferSize: maximum number of output bytes the BIOS may write to @data
+ * @nBytesReturned: set to the number of output bytes in @data
+ * @nStatus: set to the BIOS status, 0 or one of BIOSAPI_*
+ * @nFlags: 0 or BBAPI_V2_WRITE_BEHIND
+ * @nReserved: reserved, has to be 0
+ * @nDeadline: see struct bbapi_mode, 0 for no deadline
+ * @data: input on the way in, output on the way out
+ *
+ * Only the header and @nInBufferSize bytes of @data are read and only the
+ * header and @nBytesReturned bytes of @data are written back, so small
+ * requests don't pay for the full struct. The ioctl fails only for errors
+ * of the driver, a call the BIOS rejects succeeds with @nStatus set.
+ */
+struct bbapi_struct_v2 {
+	uint32_t nIndexGroup;
+	uint32_t nIndexOffset;
+	uint32_t nInBufferSize;
+	uint32_t nOutBufferSize;
+	uint32_t nBytesReturned;
+	uint32_t nStatus;
+	uint32_t nFlags;
+	uint32_t nReserved;
+	uint64_t nDeadline;
+	uint8_t data[BBAPI_V2_PAYLOAD_SIZE];
+};
+
+#define BBAPI_V2_WRITE_BEHIND 0x1 // queue a write and return without waiting for the BIOS, a newer queued write to the same IndexGroup and IndexOffset replaces it
+
+#define BBAPI_CMD_V2 _IOWR('B', 0x20, struct bbapi_struct_v2)	// BIOS call with inline payload
+
+#define BBAPI_MAX_HANDLE_LIST 32 // maximum number of handles in struct bbapi_handle_list
+
+/**
+ * struct bbapi_handle_list - prepared requests to execute under one lock hold
+ * @nCount: number of handles in @pHandles, at most BBAPI_MAX_HANDLE_LIST
+ * @nReserved: reserved, has to be 0
+ * @pHandles: handles returned by BBAPI_CMD_PREPARE
+ */
+struct bbapi_handle_list {
+	uint32_t nCount;
+	uint32_t nReserved;
+	const uint32_t __user *pHandles;
+};
+
+#define BBAPI_CMD_PREPARE _IOW('B', 0x10, struct bbapi_struct)	// register a request template, returns its handle
+#define BBAPI_CMD_EXECUTE _IO('B', 0x11)	// execute a prepared request, the argument is its handle
+#define BBAPI_CMD_EXECUTE_LIST _IOW('B', 0x12, struct bbapi_handle_list)	// execute several prepared requests
+#define BBAPI_CMD_RELEASE _IO('B', 0x13)	// release a prepared request, the argument is its handle
+
+/**
+ * Binding a file to an IndexGroup turns pread()/pwrite() into BIOS reads and
+ * writes of IndexOffset = file offset. Each read or write advances the file
+ * offset by one, so preadv()/pwritev() access adjacent IndexOffsets.
+ */
+#define BBAPI_CMD_BIND _IO('B', 0x30)	// bind the file to an IndexGroup, the argument is the IndexGroup
+
+#define BBAPI_DISPLAY_FLUSH _IO('B', 0x40)	// /dev/cx_display: send the framebuffer to the display now
+#define BBAPI_DISPLAY_SELECT _IO('B', 0x41)	// /dev/cx_display: select the virtual page the file accesses, the argument is its index
 #endif /* #ifndef WINDOWS */
 
 #define BADEVICE_MBINFO_snprintf(p, buffer, len) \
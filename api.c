@@ -10,14 +10,29 @@
 #include <linux/moduleparam.h>
 #include <linux/kernel.h>
 #include <linux/types.h>
+#include <linux/debugfs.h>
 #include <linux/delay.h>
 #include <linux/dmi.h>
 #include <linux/fs.h>
+#include <linux/hrtimer.h>
+#include <linux/idr.h>
 #include <linux/kdev_t.h>
+#include <linux/math64.h>
+#include <linux/percpu.h>
 #include <linux/platform_device.h>
+#ifndef __FreeBSD__
+#include <linux/pm_qos.h>
+#endif
+#include <linux/sched.h>
+#include <linux/seq_file.h>
 #include <linux/slab.h>
+#include <linux/spinlock.h>
 #include <linux/version.h>
 #include <linux/vmalloc.h>
+#include <linux/workqueue.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 14, 0)
+#include <linux/panic_notifier.h>
+#endif
 #include <generated/utsrelease.h>
 #include <asm/io.h>
 #if (LINUX_VERSION_CODE < KERNEL_VERSION(4,12,0))
@@ -47,6 +62,76 @@ static unsigned long g_bbapi_search_area = BBIOSAPI_SIGNATURE_SEARCH_AREA;
 module_param_named(search_area, g_bbapi_search_area, ulong, 0);
 MODULE_PARM_DESC(search_area, "Size in bytes of the area to search for the BBAPI signature.");
 
+static bool g_bbapi_coalesce_reads = true;
+module_param_named(coalesce_reads, g_bbapi_coalesce_reads, bool, 0644);
+MODULE_PARM_DESC(coalesce_reads, "Let concurrent identical reads share a single BIOS call.");
+
+static unsigned long g_bbapi_call_budget_us;
+module_param_named(call_budget_us, g_bbapi_call_budget_us, ulong, 0644);
+MODULE_PARM_DESC(call_budget_us, "BIOS calls taking longer than this hold back non-critical calls for cooldown_ms, 0 disables the jitter guard.");
+
+static unsigned int g_bbapi_cooldown_ms = 100;
+module_param_named(cooldown_ms, g_bbapi_cooldown_ms, uint, 0644);
+MODULE_PARM_DESC(cooldown_ms, "Milliseconds non-critical BIOS calls are held back after a call exceeded call_budget_us.");
+
+#ifndef __FreeBSD__
+static int g_bbapi_qos_latency_us = -1;
+module_param_named(qos_latency_us, g_bbapi_qos_latency_us, int, 0644);
+MODULE_PARM_DESC(qos_latency_us, "CPU latency limit in microseconds requested while BIOS calls are issued, -1 disables the hint.");
+
+static unsigned int g_bbapi_qos_hold_ms = 100;
+module_param_named(qos_hold_ms, g_bbapi_qos_hold_ms, uint, 0644);
+MODULE_PARM_DESC(qos_hold_ms, "Milliseconds the CPU latency limit is kept after the last BIOS call of a burst.");
+#endif
+
+/**
+ * struct bbapi_trace_entry - flight recorder slot describing one BIOS call
+ * @gen: odd while the slot is updated, bumped before and after each update
+ * @seq: global sequence number of the call, 0 marks an unused slot
+ * @start: ktime_get_ns() timestamp taken right before entering the BIOS
+ * @duration: nanoseconds spent in the BIOS including busy retries,
+ *            0 as long as the call has not returned
+ * @caller: return address of the in-kernel caller, 0 for ioctl requests
+ * @pid: pid of the task issuing the call
+ * @comm: name of the task issuing the call
+ * @group: IndexGroup of the call
+ * @offset: IndexOffset of the call
+ * @status: raw BIOS status of the last attempt
+ * @cpu: cpu the call was issued on
+ * @retries: number of retries caused by BIOSAPI_BUSY
+ */
+struct bbapi_trace_entry {
+	unsigned int gen;
+	u64 seq;
+	u64 start;
+	u64 duration;
+	unsigned long caller;
+	pid_t pid;
+	char comm[TASK_COMM_LEN];
+	uint32_t group;
+	uint32_t offset;
+	uint32_t status;
+	uint16_t cpu;
+	uint16_t retries;
+};
+
+#define BBAPI_TRACE_SIZE 32	// flight recorder slots per cpu
+
+struct bbapi_trace_ring {
+	unsigned int head;
+	struct bbapi_trace_entry entries[BBAPI_TRACE_SIZE];
+};
+
+/**
+ * The flight recorder keeps the most recent BIOS calls in a small ring per
+ * cpu. Writers never take a lock, a slot is only reused after
+ * BBAPI_TRACE_SIZE newer calls were issued on the same cpu. Since all BIOS
+ * calls are serialized by g_bbapi.mutex a slot is never reused while its
+ * call is still in flight.
+ */
+static DEFINE_PER_CPU(struct bbapi_trace_ring, g_bbapi_trace);
+static atomic64_t g_bbapi_trace_seq = ATOMIC64_INIT(0);
+
 #if defined(__i386__)
 static const uint64_t BBIOSAPI_SIGNATURE = 0x495041534F494242LL;	// API-String "BBIOSAPI"
 
@@ -104,287 +189,2455 @@ static unsigned int bbapi_call(void __kernel * const in,
 }
 #endif
 
-static unsigned int bbapi_call_retry(void __kernel * const in,
-			       void __kernel * const out,
-			       PFN_BBIOSAPI_CALL entry,
-			       const struct bbapi_struct *const cmd,
-			       unsigned int *bytes_written)
+static struct bbapi_trace_entry *bbapi_trace_begin(const struct bbapi_struct
+						   *const cmd,
+						   unsigned long caller)
 {
-	ulong retries = g_bbapi_busy_retry;
-	for (;;) {
-		const unsigned int status = bbapi_call(in, out, entry, cmd, bytes_written);
-		if (BIOSAPI_BUSY == (status | BIOSAPIERR_OFFSET)) {
-			if (retries--) {
-				pr_warn("BBAPI busy, waiting and retrying...\n");
-				msleep(100);
-				continue;
-			} else {
-				pr_err("BBAPI was busy for too long, giving up.\n");
-			}
-		}
-		return status;
-	}
+	struct bbapi_trace_ring *const ring = get_cpu_ptr(&g_bbapi_trace);
+	struct bbapi_trace_entry *const e =
+	    &ring->entries[ring->head++ % BBAPI_TRACE_SIZE];
+
+	WRITE_ONCE(e->gen, e->gen + 1);
+	smp_wmb();
+	e->seq = atomic64_inc_return(&g_bbapi_trace_seq);
+	e->start = ktime_get_ns();
+	e->duration = 0;
+	e->caller = caller;
+	e->pid = task_pid_nr(current);
+	memcpy(e->comm, current->comm, sizeof(e->comm));
+	e->group = cmd->nIndexGroup;
+	e->offset = cmd->nIndexOffset;
+	e->status = 0;
+	e->cpu = smp_processor_id();
+	e->retries = 0;
+	smp_wmb();
+	WRITE_ONCE(e->gen, e->gen + 1);
+	put_cpu_ptr(&g_bbapi_trace);
+	return e;
 }
 
-unsigned int bbapi_rw(uint32_t group, uint32_t offset,
-			     void __kernel * const in, uint32_t size_in,
-			     void __kernel * const out, const uint32_t size_out, uint32_t *bytes_written)
+static void bbapi_trace_end(struct bbapi_trace_entry *const e,
+			    unsigned int status, unsigned int retries)
 {
-	const struct bbapi_struct cmd = {
-		.nIndexGroup = group,
-		.nIndexOffset = offset,
-		.pInBuffer = NULL,
-		.nInBufferSize = size_in,
-		.pOutBuffer = NULL,
-		.nOutBufferSize = size_out
-	};
-	volatile unsigned int result = 0;
+	const u64 duration = max_t(u64, 1, ktime_get_ns() - e->start);
+
+	WRITE_ONCE(e->gen, e->gen + 1);
+	smp_wmb();
+	e->status = status;
+	e->retries = retries;
+	e->duration = duration;
+	smp_wmb();
+	WRITE_ONCE(e->gen, e->gen + 1);
+}
 
-	if (!g_bbapi.entry)
-		return BIOSAPI_SRVNOTSUPP;
+/**
+ * bbapi_trace_find() - copy the flight recorder slot of a BIOS call
+ * @seq: sequence number of the BIOS call to look up
+ * @copy: destination for a consistent copy of the slot
+ *
+ * Never waits for a writer, the panic dump may run while another cpu was
+ * stopped in the middle of an update.
+ *
+ * Return: true if the call is still recorded and was copied consistently
+ */
+static bool bbapi_trace_find(u64 seq, struct bbapi_trace_entry *copy)
+{
+	int cpu;
 
-	mutex_lock(&g_bbapi.mutex);
-	result = bbapi_call_retry(in, out, g_bbapi.entry, &cmd, bytes_written);
-	mutex_unlock(&g_bbapi.mutex);
-	if (result) {
-		pr_debug("%s(0x%x:0x%x) failed with: 0x%x\n", __func__,
-	         cmd.nIndexGroup, cmd.nIndexOffset, result);
-		return -(result | BIOSAPIERR_OFFSET);
+	for_each_possible_cpu(cpu) {
+		const struct bbapi_trace_ring *const ring =
+		    per_cpu_ptr(&g_bbapi_trace, cpu);
+		size_t i;
+
+		for (i = 0; i < BBAPI_TRACE_SIZE; ++i) {
+			const struct bbapi_trace_entry *const e =
+			    &ring->entries[i];
+			const unsigned int gen = READ_ONCE(e->gen);
+
+			if ((gen & 1) || READ_ONCE(e->seq) != seq)
+				continue;
+			smp_rmb();
+			memcpy(copy, e, sizeof(*copy));
+			smp_rmb();
+			return READ_ONCE(e->gen) == gen && copy->seq == seq;
+		}
 	}
-	return result;
+	return false;
 }
 
-unsigned int bbapi_read(uint32_t group, uint32_t offset,
-			void __kernel * const out, const uint32_t size)
+static int bbapi_trace_format(const struct bbapi_trace_entry *e, char *buf,
+			      size_t len)
 {
-	uint32_t bytes_written = 0;
-	return bbapi_rw(group, offset, NULL, 0, out, size, &bytes_written);
+	u32 nsec, usec;
+	const u64 sec = div_u64_rem(e->start, NSEC_PER_SEC, &nsec);
+
+	usec = nsec / NSEC_PER_USEC;
+
+	if (!e->duration) {
+		return scnprintf(buf, len,
+				 "#%llu cpu%u %llu.%06u %d/%.*s 0x%x:0x%x STILL RUNNING retries: %u caller: %pS\n",
+				 e->seq, e->cpu, sec, usec,
+				 e->pid, (int)sizeof(e->comm), e->comm,
+				 e->group, e->offset, e->retries,
+				 (void *)e->caller);
+	}
+	return scnprintf(buf, len,
+			 "#%llu cpu%u %llu.%06u %d/%.*s 0x%x:0x%x %llu us status: 0x%x retries: %u caller: %pS\n",
+			 e->seq, e->cpu, sec, usec, e->pid,
+			 (int)sizeof(e->comm), e->comm, e->group, e->offset,
+			 div_u64(e->duration, NSEC_PER_USEC), e->status,
+			 e->retries, (void *)e->caller);
 }
 
-EXPORT_SYMBOL(bbapi_read);
-
-unsigned int bbapi_write(uint32_t group, uint32_t offset,
-			 void __kernel * const in, uint32_t size)
-{
-	uint32_t bytes_written = 0;
-	return bbapi_rw(group, offset, in, size, NULL, 0, &bytes_written);
-}
+/* ktime_get_ns() timestamp of the end of the last BIOS call */
+static u64 g_bbapi_last_call;
 
-EXPORT_SYMBOL(bbapi_write);
+#define BBAPI_BUSY_BACKOFF_MS 100
 
-int bbapi_board_is(const char *const boardname)
-{
-	char board[CXPWRSUPP_MAX_DISPLAY_LINE] = { 0 };
+/**
+ * struct bbapi_wait - how long a caller is willing to wait for the BIOS
+ * @nonblock: never wait, neither for the lock nor for a busy BIOS
+ * @interruptible: waits can be interrupted by signals
+ * @deadline: ktime_get_ns() timestamp after which waiting is given up,
+ *            0 to wait without time limit
+ * @result: negative errno explaining why waiting was given up
+ *
+ * In-kernel callers pass NULL to wait uninterruptibly without time limit.
+ */
+struct bbapi_wait {
+	bool nonblock;
+	bool interruptible;
+	u64 deadline;
+	int result;
+};
 
-	bbapi_read(BIOSIGRP_GENERAL, BIOSIOFFS_GENERAL_GETBOARDNAME, &board,
-		   sizeof(board) - 1);
-	return 0 == strncmp(board, boardname, sizeof(board));
-}
+static void bbapi_unlock(void);
+static void bbapi_wb_cancel(uint32_t group, uint32_t offset);
 
-EXPORT_SYMBOL(bbapi_board_is);
+/**
+ * struct bbapi_qos_stats - duration of the first BIOS call of a lock hold
+ * @calls: number of calls
+ * @total: sum of their durations in nanoseconds
+ * @worst: longest of them in nanoseconds
+ */
+struct bbapi_qos_stats {
+	u64 calls;
+	u64 total;
+	u64 worst;
+};
 
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 8, 0)
-#include <linux/kprobes.h>
-static struct kprobe kp = {
-	.symbol_name = "kallsyms_lookup_name"
+/**
+ * struct bbapi_qos_state - CPU latency hint held during bursts of BIOS calls
+ * @req: the CPU latency request, added on the first burst
+ * @release: drops the hint qos_hold_ms after the last lock of a burst
+ * @held: the hint is currently applied
+ * @hinted: the hint was applied already before the current lock hold
+ * @first: the next BIOS call is the first one of the current lock hold
+ * @stats: first calls of a lock hold after an idle period [0] and within
+ *         qos_hold_ms of the previous lock hold [1]
+ *
+ * Everything but @release is protected by g_bbapi.mutex. @stats splits
+ * calls by the gap to the previous lock hold, not by the hint alone: short
+ * gaps also find warm caches and TLBs. bbapi_latency_ab() measures the
+ * effect of the hint itself.
+ */
+struct bbapi_qos_state {
+#ifndef __FreeBSD__
+	struct pm_qos_request req;
+#endif
+	struct delayed_work release;
+	bool held;
+	bool hinted;
+	bool first;
+	struct bbapi_qos_stats stats[2];
 };
 
-typedef unsigned long (*kallsyms_lookup_name_t)(const char *name);
-kallsyms_lookup_name_t fcn_kallsyms_lookup_name;
+static struct bbapi_qos_state g_bbapi_qos;
 
-typedef void *(*fcn_vmalloc_node_range_t)(unsigned long size, unsigned long align,
-		unsigned long start, unsigned long end, gfp_t gfp_mask,
-		pgprot_t prot, unsigned long vm_flags, int node,
-		const void *caller);
-fcn_vmalloc_node_range_t fcn_vmalloc_node_range;
+#ifndef __FreeBSD__
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 7, 0)
+#define bbapi_qos_add(req, value) cpu_latency_qos_add_request(req, value)
+#define bbapi_qos_update(req, value) cpu_latency_qos_update_request(req, value)
+#define bbapi_qos_remove(req) cpu_latency_qos_remove_request(req)
+#define bbapi_qos_active(req) cpu_latency_qos_request_active(req)
+#else
+#define bbapi_qos_add(req, value) \
+	pm_qos_add_request(req, PM_QOS_CPU_DMA_LATENCY, value)
+#define bbapi_qos_update(req, value) pm_qos_update_request(req, value)
+#define bbapi_qos_remove(req) pm_qos_remove_request(req)
+#define bbapi_qos_active(req) pm_qos_request_active(req)
 #endif
 
 /**
- * bbapi_copy_bios() - Copy BIOS from SPI flash into RAM
- * @bbapi: pointer to a not initialized bbapi_object
- * @pos: pointer to the BIOS identifier string in flash
- *
- * We use BIOS shadowing to increase realtime performance.
- * The BIOS identifier string is followed by the 32-Bit BIOS API
- * function offset. This offset is the location of the BIOS API entry
- * function and is located at most 4096 bytes in front of the
- * BIOS memory end. So we calculate the size of the BIOS and copy it
- * from SPI Flash into RAM.
- * Accessing the BIOS in ROM while running realtime applications would
- * otherwise have bad effects on the realtime behaviour.
- *
- * Note: PAGE_KERNEL_EXEC omits the "no execute bit" exception
- *
- * Return: 0 for success, -ENOMEM if the allocation of kernel memory fails
+ * You have to hold the lock on g_bbapi.mutex when calling this function!!!
  */
-static int __init bbapi_copy_bios(struct bbapi_object *bbapi,
-				  uint8_t __iomem * pos)
+static void bbapi_qos_begin(void)
 {
-	const uint32_t offset = ioread32(pos + 8);
-	const size_t size = offset + 4096;
+	struct bbapi_qos_state *const q = &g_bbapi_qos;
+	const int latency = READ_ONCE(g_bbapi_qos_latency_us);
 
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 8, 0)
-	bbapi->memory = fcn_vmalloc_node_range(size, 1, VMALLOC_START, VMALLOC_END,
-			GFP_KERNEL, PAGE_KERNEL_EXEC, 0, NUMA_NO_NODE, __builtin_return_address(0));
+	q->hinted = q->held;
+	q->first = true;
+	if (latency < 0) {
+		return;
+	}
+	if (!q->held) {
+		if (bbapi_qos_active(&q->req)) {
+			bbapi_qos_update(&q->req, latency);
+		} else {
+			bbapi_qos_add(&q->req, latency);
+		}
+		q->held = true;
+	}
+	mod_delayed_work(system_wq, &q->release,
+			 msecs_to_jiffies(READ_ONCE(g_bbapi_qos_hold_ms)));
+}
+
+static void bbapi_qos_release(struct work_struct *work)
+{
+	struct bbapi_qos_state *const q = &g_bbapi_qos;
+
+	/* not bbapi_lock(), that would extend the burst */
+	mutex_lock(&g_bbapi.mutex);
+	if (q->held) {
+		bbapi_qos_update(&q->req, PM_QOS_DEFAULT_VALUE);
+		q->held = false;
+	}
+	bbapi_unlock();
+}
+
+static void bbapi_qos_exit(void)
+{
+	cancel_delayed_work_sync(&g_bbapi_qos.release);
+	if (bbapi_qos_active(&g_bbapi_qos.req)) {
+		bbapi_qos_remove(&g_bbapi_qos.req);
+	}
+}
 #else
-	bbapi->memory = __vmalloc(size, GFP_KERNEL, PAGE_KERNEL_EXEC);
+static void bbapi_qos_begin(void)
+{
+	g_bbapi_qos.first = true;
+}
+
+static void bbapi_qos_release(struct work_struct *work)
+{
+}
+
+static void bbapi_qos_exit(void)
+{
+}
 #endif
-	if (bbapi->memory == NULL) {
-		pr_info("__vmalloc for Beckhoff BIOS API failed\n");
-		return -ENOMEM;
+
+/**
+ * You have to hold the lock on g_bbapi.mutex when calling this function!!!
+ */
+static void bbapi_qos_account(u64 duration)
+{
+	struct bbapi_qos_state *const q = &g_bbapi_qos;
+	struct bbapi_qos_stats *const stats = &q->stats[q->hinted];
+
+	if (!q->first) {
+		return;
 	}
-	memcpy_fromio(bbapi->memory, pos, size);
-	bbapi->entry = bbapi->memory + offset;
-	return 0;
+	q->first = false;
+	stats->calls++;
+	stats->total += duration;
+	stats->worst = max(stats->worst, duration);
 }
 
 /**
- * bbapi_find_bios() - Find BIOS in SPI flash and copy it into RAM
- * @bbapi: pointer to a not initialized bbapi_object
+ * __bbapi_lock() - acquire g_bbapi.mutex according to @wait
+ * @wait: wait constraints of the caller or NULL
  *
- * If successful bbapi->memory and bbapi->entry point to the bios in RAM
+ * Mutexes have no timed lock operation, so callers with a deadline sleep
+ * on g_bbapi.wq and retry mutex_trylock() every time bbapi_unlock() is
+ * called.
  *
- * Return: 0 if the bios was successfully copied into RAM
+ * Return: 0 if the lock is held, -EAGAIN, -EINTR, -ERESTARTSYS or -ETIMEDOUT
  */
-static int __init bbapi_find_bios(struct bbapi_object *bbapi)
+static int __bbapi_lock(struct bbapi_wait *wait)
 {
-	static const size_t STEP_SIZE = 0x10;
+	s64 remaining;
+	int result;
 
-	// Try to remap IO Memory to search the BIOS API in the memory
-	if (g_bbapi_search_area > BBIOSAPI_SIGNATURE_SEARCH_AREA) {
-		pr_warn("Search area too big\n");
-		return -EFAULT;
+	if (!wait) {
+		mutex_lock(&g_bbapi.mutex);
+		return 0;
 	}
-	uint8_t __iomem *const start = ioremap(BBIOSAPI_SIGNATURE_PHYS_START_ADDR,
-					       g_bbapi_search_area);
-	const uint8_t __iomem *const end = start + g_bbapi_search_area;
-	int result = -EFAULT;
-	uint8_t __iomem *pos;
-	size_t off;
-
-	if (start == NULL) {
-		pr_warn("Mapping memory search area for BIOS API failed\n");
-		return -ENOMEM;
+	if (wait->nonblock)
+		return mutex_trylock(&g_bbapi.mutex) ? 0 : -EAGAIN;
+	if (!wait->deadline) {
+		if (wait->interruptible)
+			return mutex_lock_interruptible(&g_bbapi.mutex);
+		mutex_lock(&g_bbapi.mutex);
+		return 0;
 	}
-	// Search through the remapped memory and look for the BIOS API String
-	for (off = 0; off < STEP_SIZE; ++off) {
-		for (pos = start + off; pos <= end - STEP_SIZE; pos += STEP_SIZE) {
-			const uint32_t low = ioread32(pos);
-			const uint32_t high = ioread32(pos + 4);
-			const uint64_t lword = ((uint64_t) high << 32 | low);
-			if (BBIOSAPI_SIGNATURE == lword) {
-				result = bbapi_copy_bios(bbapi, pos);
-				pr_info
-				    ("BIOS found and copied from: %p + 0x%zx | %zu\n",
-				     start, pos - start, off);
-				goto cleanup;
-			}
-		}
+
+	remaining = wait->deadline - ktime_get_ns();
+	if (remaining <= 0)
+		return -ETIMEDOUT;
+	if (wait->interruptible) {
+		result = wait_event_interruptible_hrtimeout(g_bbapi.wq,
+				mutex_trylock(&g_bbapi.mutex), ns_to_ktime(remaining));
+	} else {
+		result = wait_event_hrtimeout(g_bbapi.wq,
+				mutex_trylock(&g_bbapi.mutex), ns_to_ktime(remaining));
 	}
-cleanup:
-	iounmap(start);
-	return result;
+	return (result == -ETIME) ? -ETIMEDOUT : result;
 }
 
 /**
- * You have to hold the lock on bbapi->mutex when calling this function!!!
+ * bbapi_lock() - acquire g_bbapi.mutex and apply the CPU latency hint
+ * @wait: wait constraints of the caller or NULL
+ *
+ * Return: see __bbapi_lock()
  */
-static int bbapi_ioctl_mutexed(struct bbapi_object *const bbapi,
-			       const struct bbapi_struct *const cmd)
+static int bbapi_lock(struct bbapi_wait *wait)
 {
-	unsigned int written = 0;
-	unsigned int ret;
+	const int result = __bbapi_lock(wait);
 
-	if (cmd->nInBufferSize > sizeof(bbapi->in)) {
-		pr_err("%s(): nInBufferSize invalid\n", __FUNCTION__);
-		return -EINVAL;
-	}
-	if (cmd->nOutBufferSize > sizeof(bbapi->out)) {
-		pr_err("%s(): nOutBufferSize: %d invalid\n", __FUNCTION__,
-		       cmd->nOutBufferSize);
-		return -EINVAL;
-	}
-	// BIOS can operate on kernel space buffers only -> make a temporary copy
-	if (copy_from_user(bbapi->in, cmd->pInBuffer, cmd->nInBufferSize)) {
-		pr_err("%s(): copy_from_user() failed\n", __FUNCTION__);
-		return -EFAULT;
-	}
-	// Call the BIOS API
-	ret = bbapi_call_retry(bbapi->in, bbapi->out, bbapi->entry, cmd, &written);
-	if (ret) {
-		pr_debug("%s(0x%x:0x%x) failed with: 0x%x\n", __func__,
-		         cmd->nIndexGroup, cmd->nIndexOffset, ret);
-		return -(ret | BIOSAPIERR_OFFSET);
-	}
-	// Copy the BIOS output to the output buffer in user space
-	if (copy_to_user(cmd->pOutBuffer, bbapi->out, written)) {
-		pr_err("%s(): copy_to_user() failed\n", __FUNCTION__);
-		return -EFAULT;
+	if (!result) {
+		bbapi_qos_begin();
 	}
+	return result;
+}
 
-	if (cmd->pBytesReturned) {
-		put_user(written, cmd->pBytesReturned);
+static void bbapi_unlock(void)
+{
+	mutex_unlock(&g_bbapi.mutex);
+	wake_up(&g_bbapi.wq);
+}
+
+/* set by bbapi_quiesce() while the S-UPS signals a power fail */
+static int g_bbapi_quiesced;
+static atomic64_t g_bbapi_quiesce_rejected = ATOMIC64_INIT(0);
+static atomic64_t g_bbapi_quiesce_deferred = ATOMIC64_INIT(0);
+
+/**
+ * bbapi_is_critical() - calls which have to pass during a power fail
+ * @group: IndexGroup of the call
+ *
+ * Watchdog, S-UPS and user EEPROM calls are required to keep the system
+ * alive and to persist state within the energy of the S-UPS.
+ */
+static bool bbapi_is_critical(uint32_t group)
+{
+	switch (group) {
+	case BIOSIGRP_SUPS:
+	case BIOSIGRP_WATCHDOG:
+	case BIOSIGRP_UEEPROM:
+		return true;
+	default:
+		return false;
 	}
-	return 0;
 }
 
-static long bbapi_ioctl(struct file *f, unsigned int cmd, unsigned long arg)
+static bool bbapi_quiesce_active(uint32_t group)
 {
-	struct bbapi_struct bbstruct;
-	size_t size = sizeof(bbstruct);
-	int result = -EINVAL;
-	if (!g_bbapi.entry) {
-		pr_warn("%s(): not initialized.\n", __FUNCTION__);
+	return READ_ONCE(g_bbapi_quiesced) && !bbapi_is_critical(group);
+}
+
+/**
+ * bbapi_quiesce_rejects() - check if a call is rejected by quiesce mode
+ * @group: IndexGroup of the call
+ *
+ * Callers check once before waiting for the BIOS lock and again after
+ * they got it, because quiesce mode may have been entered meanwhile.
+ * Calls the BIOS reported busy check again before each retry.
+ *
+ * Return: true if the call must not be executed
+ */
+static bool bbapi_quiesce_rejects(uint32_t group)
+{
+	if (likely(!bbapi_quiesce_active(group))) {
+		return false;
+	}
+	atomic64_inc(&g_bbapi_quiesce_rejected);
+	return true;
+}
+
+/**
+ * bbapi_busy_backoff() - sleep before retrying a call the BIOS reported busy
+ * @wait: wait constraints of the caller or NULL
+ * @retries: remaining number of retries
+ * @group: IndexGroup of the call
+ *
+ * Non-critical calls give up as soon as quiesce mode is entered, even in
+ * the middle of the sleep. Otherwise they would keep g_bbapi.mutex from
+ * the critical calls for up to busy_retry backoffs.
+ *
+ * Return: true if the call should be retried, otherwise @wait->result
+ * tells why not.
+ */
+static bool bbapi_busy_backoff(struct bbapi_wait *wait, ulong *retries,
+			       uint32_t group)
+{
+	const unsigned long timeout = msecs_to_jiffies(BBAPI_BUSY_BACKOFF_MS);
+
+	if (bbapi_quiesce_rejects(group)) {
+		if (wait) {
+			wait->result = -EBUSY;
+		}
+		return false;
+	}
+	if (wait && wait->nonblock) {
+		wait->result = -EAGAIN;
+		return false;
+	}
+	if (!*retries) {
+		pr_err("BBAPI was busy for too long, giving up.\n");
+		return false;
+	}
+	if (wait && wait->deadline &&
+	    ktime_get_ns() + BBAPI_BUSY_BACKOFF_MS * NSEC_PER_MSEC > wait->deadline) {
+		wait->result = -ETIMEDOUT;
+		return false;
+	}
+	--*retries;
+	pr_warn("BBAPI busy, waiting and retrying...\n");
+	/* bbapi_quiesce() wakes up g_bbapi.wq */
+	if (wait && wait->interruptible) {
+		if (wait_event_interruptible_timeout(g_bbapi.wq,
+				bbapi_quiesce_active(group), timeout) < 0) {
+			wait->result = -EINTR;
+			return false;
+		}
+	} else {
+		wait_event_timeout(g_bbapi.wq, bbapi_quiesce_active(group),
+				   timeout);
+	}
+	if (bbapi_quiesce_rejects(group)) {
+		if (wait) {
+			wait->result = -EBUSY;
+		}
+		return false;
+	}
+	return true;
+}
+
+/**
+ * struct bbapi_jitter_guard - holds back non-critical calls after slow ones
+ * @until: ktime_get_ns() timestamp the current cool-down ends
+ * @worst: longest single BIOS call in nanoseconds
+ * @overruns: number of BIOS calls which exceeded call_budget_us
+ * @throttled: number of calls delayed until the end of a cool-down
+ * @rejected: number of calls failed, because they couldn't wait long enough
+ * @deferred: number of polls deferred to their next period
+ *
+ * @until and @worst are only written with g_bbapi.mutex held.
+ */
+struct bbapi_jitter_guard {
+	u64 until;
+	u64 worst;
+	atomic64_t overruns;
+	atomic64_t throttled;
+	atomic64_t rejected;
+	atomic64_t deferred;
+};
+
+static struct bbapi_jitter_guard g_bbapi_guard;
+
+/**
+ * bbapi_guard_account() - start a cool-down if a call exceeded its budget
+ * @duration: nanoseconds spent in a single BIOS call
+ *
+ * Busy backoffs are not accounted, they sleep and don't block the cpu.
+ * You have to hold the lock on g_bbapi.mutex when calling this function!!!
+ */
+static void bbapi_guard_account(u64 duration)
+{
+	const u64 budget = READ_ONCE(g_bbapi_call_budget_us) * NSEC_PER_USEC;
+	struct bbapi_jitter_guard *const g = &g_bbapi_guard;
+
+	if (duration > g->worst) {
+		g->worst = duration;
+	}
+	if (!budget || duration <= budget) {
+		return;
+	}
+	atomic64_inc(&g->overruns);
+	WRITE_ONCE(g->until, ktime_get_ns() +
+		   (u64)READ_ONCE(g_bbapi_cooldown_ms) * NSEC_PER_MSEC);
+}
+
+static bool bbapi_guard_active(u64 now)
+{
+	return READ_ONCE(g_bbapi_guard.until) > now;
+}
+
+static unsigned int __bbapi_call_retry(void __kernel * const in,
+			       void __kernel * const out,
+			       PFN_BBIOSAPI_CALL entry,
+			       const struct bbapi_struct *const cmd,
+			       unsigned int *bytes_written,
+			       unsigned long caller, struct bbapi_wait *wait)
+{
+	struct bbapi_trace_entry *const trace = bbapi_trace_begin(cmd, caller);
+	ulong retries = g_bbapi_busy_retry;
+
+	for (;;) {
+		const u64 start = ktime_get_ns();
+		const unsigned int status = bbapi_call(in, out, entry, cmd, bytes_written);
+		const u64 duration = ktime_get_ns() - start;
+
+		bbapi_guard_account(duration);
+		bbapi_qos_account(duration);
+		if (BIOSAPI_BUSY == (status | BIOSAPIERR_OFFSET) &&
+		    bbapi_busy_backoff(wait, &retries, cmd->nIndexGroup)) {
+			continue;
+		}
+		bbapi_trace_end(trace, status, g_bbapi_busy_retry - retries);
+		WRITE_ONCE(g_bbapi_last_call, ktime_get_ns());
+		return status;
+	}
+}
+
+/**
+ * bbapi_call_retry() - execute a synchronous BIOS call
+ *
+ * A write, input data and no output, supersedes a write to the same
+ * IndexGroup and IndexOffset still queued by bbapi_write_behind(). Queued
+ * writes themselves are executed by bbapi_wb_work() with
+ * __bbapi_call_retry().
+ * You have to hold the lock on g_bbapi.mutex when calling this function!!!
+ */
+static unsigned int bbapi_call_retry(void __kernel * const in,
+			       void __kernel * const out,
+			       PFN_BBIOSAPI_CALL entry,
+			       const struct bbapi_struct *const cmd,
+			       unsigned int *bytes_written,
+			       unsigned long caller, struct bbapi_wait *wait)
+{
+	if (cmd->nInBufferSize && !cmd->nOutBufferSize) {
+		bbapi_wb_cancel(cmd->nIndexGroup, cmd->nIndexOffset);
+	}
+	return __bbapi_call_retry(in, out, entry, cmd, bytes_written, caller,
+				  wait);
+}
+
+/**
+ * bbapi_throttle() - hold back a non-critical call during a cool-down
+ * @group: IndexGroup of the call
+ * @wait: wait constraints of the caller or NULL
+ *
+ * Callers check before waiting for the BIOS lock. A cool-down started
+ * while they wait for the lock doesn't hold them back anymore.
+ *
+ * Return: 0 if the call may proceed, -EAGAIN, -EINTR or -ETIMEDOUT if the
+ * cool-down lasts longer than @wait allows to wait
+ */
+static int bbapi_throttle(uint32_t group, struct bbapi_wait *wait)
+{
+	struct bbapi_jitter_guard *const g = &g_bbapi_guard;
+	bool counted = false;
+	unsigned int ms;
+	u64 now, until;
+
+	if (bbapi_is_critical(group)) {
+		return 0;
+	}
+	for (;;) {
+		until = READ_ONCE(g->until);
+		now = ktime_get_ns();
+		if (until <= now) {
+			return 0;
+		}
+		if (wait && wait->nonblock) {
+			atomic64_inc(&g->rejected);
+			return -EAGAIN;
+		}
+		if (wait && wait->deadline && until > wait->deadline) {
+			atomic64_inc(&g->rejected);
+			return -ETIMEDOUT;
+		}
+		if (!counted) {
+			atomic64_inc(&g->throttled);
+			counted = true;
+		}
+		ms = DIV_ROUND_UP_ULL(until - now, NSEC_PER_MSEC);
+		if (wait && wait->interruptible) {
+			if (msleep_interruptible(ms)) {
+				return -EINTR;
+			}
+		} else {
+			msleep(ms);
+		}
+	}
+}
+
+/**
+ * struct bbapi_persist_state - blob written to the user EEPROM on power fail
+ * @lock: serializes updates of the blob
+ * @slots: double buffer in RAM, updates are written to the slot not published
+ * @active: index of the published slot, -1 if nothing is armed
+ * @frozen: set on power fail, no updates are accepted until power returns
+ * @work: writes the published slot to the user EEPROM
+ * @writes: number of power fail writes
+ * @status: result of the last power fail write
+ * @duration: nanoseconds from power fail detection to the end of the write
+ * @triggered: ktime_get_ns() timestamp of the power fail detection
+ */
+struct bbapi_persist_state {
+	struct mutex lock;
+	uint8_t slots[2][BBAPI_UEEPROM_SIZE];
+	int active;
+	int frozen;
+	struct work_struct work;
+	u64 writes;
+	unsigned int status;
+	u64 duration;
+	u64 triggered;
+};
+
+static struct bbapi_persist_state g_bbapi_persist = {
+	.active = -1,
+};
+
+/**
+ * bbapi_persist() - arm the write of a blob to the user EEPROM on power fail
+ * @data: blob to write
+ * @size: size of @data, at most BBAPI_UEEPROM_SIZE, 0 to disarm
+ *
+ * The blob is copied into the slot not used by the power fail write and
+ * published afterwards, so a power fail always writes a complete blob.
+ * The EEPROM itself holds a single image, which BIOSIOFFS_UEEPROM_WRITE
+ * overwrites in place. If the S-UPS runs out of energy during that write
+ * the image is torn and no previous copy is left.
+ *
+ * Return: 0 for success, -EINVAL if @size is too large, -EBUSY if a power
+ * fail is already being handled
+ */
+int bbapi_persist(const void __kernel * const data, const size_t size)
+{
+	struct bbapi_persist_state *const p = &g_bbapi_persist;
+	int result = 0;
+	int next;
+
+	if (size > BBAPI_UEEPROM_SIZE) {
+		return -EINVAL;
+	}
+	mutex_lock(&p->lock);
+	if (READ_ONCE(p->frozen)) {
+		result = -EBUSY;
+	} else if (!size) {
+		smp_store_release(&p->active, -1);
+	} else {
+		next = (READ_ONCE(p->active) == 0) ? 1 : 0;
+		memcpy(p->slots[next], data, size);
+		memset(p->slots[next] + size, 0, BBAPI_UEEPROM_SIZE - size);
+		smp_store_release(&p->active, next);
+	}
+	mutex_unlock(&p->lock);
+	return result;
+}
+
+EXPORT_SYMBOL(bbapi_persist);
+
+/**
+ * bbapi_persist_work() - write the published slot to the user EEPROM
+ *
+ * A BIOS call in flight can't be interrupted, the write waits for it.
+ * Non-critical calls give up their busy backoff once quiesce mode is
+ * entered, so only a single BIOS call or a critical call can delay the
+ * write.
+ */
+static void bbapi_persist_work(struct work_struct *work)
+{
+	struct bbapi_persist_state *const p = &g_bbapi_persist;
+	const int active = smp_load_acquire(&p->active);
+	const struct bbapi_struct cmd = {
+		.nIndexGroup = BIOSIGRP_UEEPROM,
+		.nIndexOffset = BIOSIOFFS_UEEPROM_WRITE,
+		.nInBufferSize = BBAPI_UEEPROM_SIZE,
+	};
+	uint32_t bytes_written = 0;
+
+	if (active < 0) {
+		return;
+	}
+	bbapi_lock(NULL);
+	p->status = bbapi_call_retry(p->slots[active], NULL, g_bbapi.entry,
+				     &cmd, &bytes_written,
+				     (unsigned long)bbapi_persist_work, NULL);
+	bbapi_unlock();
+	p->duration = ktime_get_ns() - p->triggered;
+	p->writes++;
+	if (p->status) {
+		pr_err("power fail write to user EEPROM failed with: 0x%x\n",
+		       p->status);
+	}
+}
+
+/**
+ * bbapi_quiesce() - enter or leave power-fail quiesce mode
+ * @enable: true to reject all but critical BIOS calls
+ *
+ * While quiesced, non-critical calls fail with -EBUSY and non-critical
+ * polls are deferred, so the BIOS stays available for the watchdog, the
+ * S-UPS and persisting data to the user EEPROM. Entering quiesce mode
+ * writes the blob armed with bbapi_persist() from a high priority work.
+ * Can be called from any context.
+ */
+void bbapi_quiesce(bool enable)
+{
+	if (xchg(&g_bbapi_quiesced, enable) == enable) {
+		return;
+	}
+	if (enable) {
+		/* updates of the blob stop before the write is triggered */
+		WRITE_ONCE(g_bbapi_persist.frozen, 1);
+		g_bbapi_persist.triggered = ktime_get_ns();
+		queue_work(system_highpri_wq, &g_bbapi_persist.work);
+		/* abort the backoff of a non-critical call holding the lock */
+		wake_up_all(&g_bbapi.wq);
+		pr_warn("power fail, only critical BIOS calls are executed\n");
+	} else {
+		WRITE_ONCE(g_bbapi_persist.frozen, 0);
+		pr_info("power restored, resuming all BIOS calls\n");
+	}
+}
+
+EXPORT_SYMBOL(bbapi_quiesce);
+
+/**
+ * bbapi_read_is_pure() - reads which may share a single BIOS call
+ * @group: IndexGroup of the read
+ * @offset: IndexOffset of the read
+ *
+ * Only reads without side effects qualify. Reads which reset the value
+ * they return, like BIOSIOFFS_SUPS_GET_SHUTDOWN_TYPE, and commands
+ * without output, like BIOSIOFFS_WATCHDOG_IORETRIGGER, have to reach the
+ * BIOS once per caller.
+ */
+static bool bbapi_read_is_pure(uint32_t group, uint32_t offset)
+{
+	switch (group) {
+	case BIOSIGRP_GENERAL:
+		return offset <= BIOSIOFFS_GENERAL_GETPLATFORMINFO;
+	case BIOSIGRP_SYSTEM:
+		/* sensor count and sensor infos */
+		return offset <= 0xFF;
+	case BIOSIGRP_SERVICES:
+		return offset <= BIOSIOFFS_SERVICES_GPIOREADMASK1;
+	case BIOSIGRP_PWRCTRL:
+		return offset <= BIOSIOFFS_PWRCTRL_TEST_NUMBER;
+	case BIOSIGRP_SUPS:
+		switch (offset) {
+		case BIOSIOFFS_SUPS_STATUS:
+		case BIOSIOFFS_SUPS_REVISION:
+		case BIOSIOFFS_SUPS_PWRFAIL_COUNTER:
+		case BIOSIOFFS_SUPS_PWRFAIL_TIMES:
+		case BIOSIOFFS_SUPS_INTERNAL_PWRF_STATUS:
+		case BIOSIOFFS_SUPS_TEST_RESULT:
+		case BIOSIOFFS_SUPS_GPIO_PIN:
+		case BIOSIOFFS_SUPS_GPIO_PIN_EX:
+			return true;
+		default:
+			return false;
+		}
+	case BIOSIGRP_WATCHDOG:
+		switch (offset) {
+		case BIOSIOFFS_WATCHDOG_GETCONFIG:
+		case BIOSIOFFS_WATCHDOG_GPIO_PIN:
+		case BIOSIOFFS_WATCHDOG_GPIO_PIN_EX:
+			return true;
+		default:
+			return false;
+		}
+	case BIOSIGRP_UEEPROM:
+		return offset == BIOSIOFFS_UEEPROM_READ;
+	case BIOSIGRP_CXPWRSUPP:
+		return (offset >= BIOSIOFFS_CXPWRSUPP_GETTYPE &&
+			offset <= BIOSIOFFS_CXPWRSUPP_GETOPERATIONTIME) ||
+		    (offset >= BIOSIOFFS_CXPWRSUPP_GET5VOLT &&
+		     offset <= BIOSIOFFS_CXPWRSUPP_GETMAXPOWER) ||
+		    offset == BIOSIOFFS_CXPWRSUPP_GETBUTTONSTATE;
+	case BIOSIGRP_CXUPS:
+		switch (offset) {
+		case BIOSIOFFS_CXUPS_GETENABLED:
+		case BIOSIOFFS_CXUPS_GETFIRMWAREVER:
+		case BIOSIOFFS_CXUPS_GETPOWERSTATUS:
+		case BIOSIOFFS_CXUPS_GETBATTERYSTATUS:
+		case BIOSIOFFS_CXUPS_GETBATTERYCAPACITY:
+		case BIOSIOFFS_CXUPS_GETBATTERYRUNTIME:
+		case BIOSIOFFS_CXUPS_GETBOOTCOUNTER:
+		case BIOSIOFFS_CXUPS_GETOPERATIONTIME:
+		case BIOSIOFFS_CXUPS_GETPOWERFAILCOUNT:
+		case BIOSIOFFS_CXUPS_GETBATTERYCRITICAL:
+		case BIOSIOFFS_CXUPS_GETBATTERYPRESENT:
+		case BIOSIOFFS_CXUPS_GETBATTSERIALNUMBER:
+		case BIOSIOFFS_CXUPS_GETBATTHARDWAREVERSION:
+		case BIOSIOFFS_CXUPS_GETBATTPRODUCTIONDATE:
+		case BIOSIOFFS_CXUPS_GETLASTBATTCHANGEDATE:
+		case BIOSIOFFS_CXUPS_GETBATTRATEDCAPACITY:
+		case BIOSIOFFS_CXUPS_GETSMBUSADDRESS:
+			return true;
+		default:
+			return offset >= BIOSIOFFS_CXUPS_GETOUTPUTVOLT &&
+			    offset <= BIOSIOFFS_CXUPS_GETMAXDISCHARGINGPOWER;
+		}
+	default:
+		return false;
+	}
+}
+
+/**
+ * bbapi_may_coalesce() - check if a call can share its BIOS call
+ * @group: IndexGroup of the call
+ * @offset: IndexOffset of the call
+ * @size_in: nInBufferSize of the call
+ * @size_out: nOutBufferSize of the call
+ */
+static bool bbapi_may_coalesce(uint32_t group, uint32_t offset,
+			       uint32_t size_in, uint32_t size_out)
+{
+	return READ_ONCE(g_bbapi_coalesce_reads) && !size_in && size_out &&
+	    size_out <= BBAPI_BUFFER_SIZE && bbapi_read_is_pure(group, offset);
+}
+
+/**
+ * struct bbapi_shared_read - a pending BIOS read other callers can attach to
+ * @node: entry in g_bbapi_reads.pending until the read has completed
+ * @group: IndexGroup of the read
+ * @offset: IndexOffset of the read
+ * @size: nOutBufferSize of the read
+ * @users: number of callers waiting for or consuming the result
+ * @done: completed once @result, @written and @out are valid
+ * @released: completed when the last attached caller is done with @out
+ * @aborted: the issuing caller gave up waiting, because of its own
+ *           deadline, signal or nonblocking mode
+ * @result: 0 or a negative errno
+ * @status: status returned by the BIOS, valid if @result is 0
+ * @written: number of bytes the BIOS wrote to @out
+ * @out: output buffer of the issuing caller, holds the result of the read
+ *
+ * Lives on the stack of the issuing caller, which waits for @released
+ * before it returns.
+ */
+struct bbapi_shared_read {
+	struct list_head node;
+	uint32_t group;
+	uint32_t offset;
+	uint32_t size;
+	unsigned int users;
+	struct completion done;
+	struct completion released;
+	bool aborted;
+	int result;
+	unsigned int status;
+	uint32_t written;
+	void *out;
+};
+
+/**
+ * struct bbapi_read_registry - reads currently queued for or executing in the BIOS
+ * @lock: protects @pending and bbapi_shared_read::users
+ * @pending: list of bbapi_shared_read not yet completed
+ * @reads: number of coalescable reads requested
+ * @coalesced: number of reads served by another caller's BIOS call
+ */
+struct bbapi_read_registry {
+	struct mutex lock;
+	struct list_head pending;
+	atomic64_t reads;
+	atomic64_t coalesced;
+};
+
+static struct bbapi_read_registry g_bbapi_reads;
+
+static void bbapi_shared_read_put(struct bbapi_shared_read *r)
+{
+	bool last;
+
+	mutex_lock(&g_bbapi_reads.lock);
+	last = !--r->users;
+	mutex_unlock(&g_bbapi_reads.lock);
+	if (last) {
+		complete(&r->released);
+	}
+}
+
+/**
+ * bbapi_wait_for() - wait for a completion according to @wait
+ * @done: completion to wait for
+ * @wait: wait constraints of the caller or NULL, nonblocking callers
+ *        must not wait at all
+ *
+ * Return: 0 if @done completed, -ERESTARTSYS or -ETIMEDOUT
+ */
+static int bbapi_wait_for(struct completion *done,
+			  const struct bbapi_wait *wait)
+{
+	s64 remaining;
+	long result;
+
+	if (!wait || (!wait->interruptible && !wait->deadline)) {
+		wait_for_completion(done);
+		return 0;
+	}
+	if (!wait->deadline)
+		return wait_for_completion_interruptible(done);
+
+	remaining = wait->deadline - ktime_get_ns();
+	if (remaining <= 0)
+		return -ETIMEDOUT;
+	if (wait->interruptible) {
+		result = wait_for_completion_interruptible_timeout(done,
+				nsecs_to_jiffies(remaining));
+	} else {
+		result = wait_for_completion_timeout(done,
+				nsecs_to_jiffies(remaining));
+	}
+	if (result < 0)
+		return result;
+	return result ? 0 : -ETIMEDOUT;
+}
+
+/**
+ * bbapi_read_locked() - issue a read and release g_bbapi.mutex
+ * @status: status returned by the BIOS, only valid if 0 is returned
+ *
+ * You have to hold the lock on g_bbapi.mutex when calling this function!!!
+ *
+ * Return: 0 or a negative errno
+ */
+static int bbapi_read_locked(uint32_t group, uint32_t offset,
+			     void __kernel * const out, uint32_t size,
+			     uint32_t *bytes_written, unsigned int *status,
+			     unsigned long caller, struct bbapi_wait *wait)
+{
+	const struct bbapi_struct cmd = {
+		.nIndexGroup = group,
+		.nIndexOffset = offset,
+		.nOutBufferSize = size,
+	};
+
+	if (bbapi_quiesce_rejects(group)) {
+		bbapi_unlock();
+		return -EBUSY;
+	}
+	*status = bbapi_call_retry(NULL, out, g_bbapi.entry, &cmd,
+				   bytes_written, caller, wait);
+	bbapi_unlock();
+	return wait ? wait->result : 0;
+}
+
+/**
+ * bbapi_read_coalesced() - read from the BIOS, sharing the call with
+ *                          identical concurrent reads
+ * @group: IndexGroup
+ * @offset: IndexOffset
+ * @out: destination buffer of at least @size bytes
+ * @size: number of bytes to read, at most BBAPI_BUFFER_SIZE
+ * @bytes_written: number of bytes written to @out
+ * @status: status returned by the BIOS, only valid if 0 is returned
+ * @caller: return address of the in-kernel caller, 0 for ioctl requests
+ * @wait: wait constraints of the caller or NULL, nonblocking callers
+ *        must not use this function
+ *
+ * Callers have to check bbapi_may_coalesce() first. If a read of the same
+ * group, offset and size is already queued or executing, the caller
+ * attaches to it and gets a copy of its result instead of calling the
+ * BIOS again. Otherwise the caller registers its own read before it takes
+ * the BIOS lock, even if the lock is free, so identical reads arriving
+ * while it executes can attach to it. If the issuing caller gives up because of its own deadline,
+ * signal or nonblocking mode, attached callers try again on their own.
+ *
+ * Return: 0 or a negative errno
+ */
+static int bbapi_read_coalesced(uint32_t group, uint32_t offset,
+				void __kernel * const out, uint32_t size,
+				uint32_t *bytes_written, unsigned int *status,
+				unsigned long caller, struct bbapi_wait *wait)
+{
+	struct bbapi_shared_read own;
+	struct bbapi_shared_read *r;
+	uint32_t written = 0;
+	bool last;
+	int result;
+
+	*status = 0;
+	atomic64_inc(&g_bbapi_reads.reads);
+	mutex_lock(&g_bbapi_reads.lock);
+retry:
+	list_for_each_entry(r, &g_bbapi_reads.pending, node) {
+		if (r->group == group && r->offset == offset && r->size == size) {
+			r->users++;
+			mutex_unlock(&g_bbapi_reads.lock);
+			atomic64_inc(&g_bbapi_reads.coalesced);
+
+			result = bbapi_wait_for(&r->done, wait);
+			if (!result && r->aborted) {
+				bbapi_shared_read_put(r);
+				atomic64_dec(&g_bbapi_reads.coalesced);
+				mutex_lock(&g_bbapi_reads.lock);
+				goto retry;
+			}
+			if (!result) {
+				result = r->result;
+				*status = r->status;
+			}
+			if (!result && !*status) {
+				written = min(r->written, size);
+				memcpy(out, r->out, written);
+				if (bytes_written) {
+					*bytes_written = written;
+				}
+			}
+			bbapi_shared_read_put(r);
+			return result;
+		}
+	}
+
+	r = &own;
+	r->group = group;
+	r->offset = offset;
+	r->size = size;
+	r->users = 1;
+	r->aborted = false;
+	r->status = 0;
+	r->written = 0;
+	r->out = out;
+	init_completion(&r->done);
+	init_completion(&r->released);
+	list_add_tail(&r->node, &g_bbapi_reads.pending);
+	mutex_unlock(&g_bbapi_reads.lock);
+
+	result = bbapi_lock(wait);
+	if (result) {
+		r->aborted = true;
+	} else {
+		result = bbapi_read_locked(group, offset, out, size,
+					   &r->written, &r->status, caller,
+					   wait);
+		r->aborted = wait && wait->result;
+	}
+	r->result = result;
+
+	mutex_lock(&g_bbapi_reads.lock);
+	list_del(&r->node);
+	last = !--r->users;
+	mutex_unlock(&g_bbapi_reads.lock);
+	complete_all(&r->done);
+	if (!last) {
+		/* attached callers still copy from @out */
+		wait_for_completion(&r->released);
+	}
+	*status = r->status;
+	if (!result && !r->status && bytes_written) {
+		*bytes_written = min(r->written, size);
+	}
+	return result;
+}
+
+static unsigned int __bbapi_rw(uint32_t group, uint32_t offset,
+			       void __kernel * const in, uint32_t size_in,
+			       void __kernel * const out,
+			       const uint32_t size_out, uint32_t *bytes_written,
+			       unsigned long caller)
+{
+	const struct bbapi_struct cmd = {
+		.nIndexGroup = group,
+		.nIndexOffset = offset,
+		.pInBuffer = NULL,
+		.nInBufferSize = size_in,
+		.pOutBuffer = NULL,
+		.nOutBufferSize = size_out
+	};
+	volatile unsigned int result = 0;
+
+	if (!g_bbapi.entry)
+		return BIOSAPI_SRVNOTSUPP;
+
+	if (bbapi_quiesce_rejects(group))
+		return -EBUSY;
+
+	bbapi_throttle(group, NULL);
+
+	if (bbapi_may_coalesce(group, offset, size_in, size_out)) {
+		unsigned int status;
+		const int err = bbapi_read_coalesced(group, offset, out,
+						     size_out, bytes_written,
+						     &status, caller, NULL);
+
+		if (err) {
+			return err;
+		}
+		return status ? -(status | BIOSAPIERR_OFFSET) : 0;
+	}
+
+	bbapi_lock(NULL);
+	if (bbapi_quiesce_rejects(group)) {
+		bbapi_unlock();
+		return -EBUSY;
+	}
+	result = bbapi_call_retry(in, out, g_bbapi.entry, &cmd, bytes_written,
+				  caller, NULL);
+	bbapi_unlock();
+	if (result) {
+		pr_debug("%s(0x%x:0x%x) failed with: 0x%x\n", __func__,
+	         cmd.nIndexGroup, cmd.nIndexOffset, result);
+		return -(result | BIOSAPIERR_OFFSET);
+	}
+	return result;
+}
+
+unsigned int bbapi_rw(uint32_t group, uint32_t offset,
+			     void __kernel * const in, uint32_t size_in,
+			     void __kernel * const out, const uint32_t size_out, uint32_t *bytes_written)
+{
+	return __bbapi_rw(group, offset, in, size_in, out, size_out,
+			  bytes_written, _RET_IP_);
+}
+
+unsigned int bbapi_read(uint32_t group, uint32_t offset,
+			void __kernel * const out, const uint32_t size)
+{
+	uint32_t bytes_written = 0;
+	return __bbapi_rw(group, offset, NULL, 0, out, size, &bytes_written,
+			  _RET_IP_);
+}
+
+EXPORT_SYMBOL(bbapi_read);
+
+unsigned int bbapi_write(uint32_t group, uint32_t offset,
+			 void __kernel * const in, uint32_t size)
+{
+	uint32_t bytes_written = 0;
+	return __bbapi_rw(group, offset, in, size, NULL, 0, &bytes_written,
+			  _RET_IP_);
+}
+
+EXPORT_SYMBOL(bbapi_write);
+
+/**
+ * You have to hold the lock on g_bbapi.mutex when calling this function!!!
+ */
+static unsigned int bbapi_rw_multi_mutexed(struct bbapi_xfer *const xfers,
+					   const size_t num,
+					   unsigned long caller)
+{
+	unsigned int result = 0;
+	size_t i;
+
+	for (i = 0; i < num; ++i) {
+		struct bbapi_xfer *const x = &xfers[i];
+		const struct bbapi_struct cmd = {
+			.nIndexGroup = x->group,
+			.nIndexOffset = x->offset,
+			.nInBufferSize = x->size_in,
+			.nOutBufferSize = x->size_out,
+		};
+		uint32_t bytes_written = 0;
+		unsigned int status;
+
+		if (bbapi_quiesce_rejects(x->group)) {
+			x->status = -EBUSY;
+		} else {
+			status = bbapi_call_retry(x->in, x->out, g_bbapi.entry,
+						  &cmd, &bytes_written, caller,
+						  NULL);
+			x->status = status ? -(status | BIOSAPIERR_OFFSET) : 0;
+		}
+		if (!result) {
+			result = x->status;
+		}
+	}
+	return result;
+}
+
+/**
+ * bbapi_rw_multi() - execute several BIOS calls under one lock hold
+ * @xfers: array of BIOS calls, executed in order
+ * @num: number of elements in @xfers
+ *
+ * No other BIOS call can interleave with the batch, so the results form a
+ * consistent snapshot. All calls are executed even if one of them fails,
+ * the result of each call is stored in its bbapi_xfer::status.
+ *
+ * Return: 0 if all calls succeeded, otherwise the status of the first
+ * failed call.
+ */
+unsigned int bbapi_rw_multi(struct bbapi_xfer *const xfers, const size_t num)
+{
+	unsigned int result;
+	size_t i;
+
+	if (!g_bbapi.entry)
+		return BIOSAPI_SRVNOTSUPP;
+
+	for (i = 0; i < num; ++i) {
+		if (!bbapi_is_critical(xfers[i].group)) {
+			bbapi_throttle(xfers[i].group, NULL);
+			break;
+		}
+	}
+	bbapi_lock(NULL);
+	result = bbapi_rw_multi_mutexed(xfers, num, _RET_IP_);
+	bbapi_unlock();
+	return result;
+}
+
+EXPORT_SYMBOL(bbapi_rw_multi);
+
+#define BBAPI_WRITE_BEHIND_SLOTS 32	// distinct targets with a pending write
+
+/**
+ * struct bbapi_wb_slot - pending write of the write-behind queue
+ * @pending: the slot holds a write, which was not flushed yet
+ * @seq: submission order of the first write to this target since the
+ *       last flush, newer writes replacing it keep its position
+ * @group: IndexGroup of the write
+ * @offset: IndexOffset of the write
+ * @size: number of bytes in @data
+ * @data: the latest data written to the target
+ */
+struct bbapi_wb_slot {
+	bool pending;
+	u64 seq;
+	uint32_t group;
+	uint32_t offset;
+	uint32_t size;
+	uint8_t data[BBAPI_BUFFER_SIZE];
+};
+
+/**
+ * struct bbapi_write_behind - fire-and-forget writes, last value wins
+ * @lock: protects @slots and @seq, taken with interrupts disabled
+ * @slots: writes waiting for @work
+ * @seq: submission counter
+ * @work: executes the pending writes in submission order
+ * @buf: copy of the slot @work is executing, only used by @work
+ * @submitted: number of writes submitted
+ * @replaced: number of writes replaced by a newer write to the same target
+ * @flushed: number of writes executed
+ * @failed: number of writes the BIOS reported an error for
+ * @dropped: number of writes dropped, because quiesce mode rejected them
+ */
+struct bbapi_write_behind {
+	spinlock_t lock;
+	struct bbapi_wb_slot slots[BBAPI_WRITE_BEHIND_SLOTS];
+	u64 seq;
+	struct work_struct work;
+	struct bbapi_wb_slot buf;
+	u64 submitted;
+	u64 replaced;
+	u64 flushed;
+	u64 failed;
+	u64 dropped;
+};
+
+static struct bbapi_write_behind g_bbapi_wb;
+
+/**
+ * bbapi_write_behind() - queue a write to be executed asynchronously
+ * @group: IndexGroup
+ * @offset: IndexOffset
+ * @in: data to write, copied before this function returns
+ * @size: size of @in, at most BBAPI_BUFFER_SIZE
+ *
+ * A pending write to the same @group and @offset is replaced, so only the
+ * latest value is written. A synchronous write to the same target drops
+ * the pending write. Errors reported by the BIOS are only counted.
+ * Can be called from any context.
+ *
+ * Return: 0 for success, -EINVAL if @size is too large, -EBUSY in quiesce
+ * mode or -ENOSPC if too many other targets have writes pending
+ */
+int bbapi_write_behind(uint32_t group, uint32_t offset,
+		       const void __kernel * const in, uint32_t size)
+{
+	struct bbapi_write_behind *const wb = &g_bbapi_wb;
+	struct bbapi_wb_slot *slot = NULL;
+	unsigned long flags;
+	size_t i;
+
+	if (size > BBAPI_BUFFER_SIZE) {
+		return -EINVAL;
+	}
+	if (bbapi_quiesce_rejects(group)) {
+		return -EBUSY;
+	}
+
+	spin_lock_irqsave(&wb->lock, flags);
+	for (i = 0; i < ARRAY_SIZE(wb->slots); ++i) {
+		struct bbapi_wb_slot *const s = &wb->slots[i];
+
+		if (!s->pending) {
+			slot = slot ? slot : s;
+		} else if (s->group == group && s->offset == offset) {
+			slot = s;
+			wb->replaced++;
+			break;
+		}
+	}
+	if (!slot) {
+		spin_unlock_irqrestore(&wb->lock, flags);
+		return -ENOSPC;
+	}
+	if (!slot->pending) {
+		slot->pending = true;
+		slot->seq = wb->seq++;
+		slot->group = group;
+		slot->offset = offset;
+	}
+	slot->size = size;
+	memcpy(slot->data, in, size);
+	wb->submitted++;
+	spin_unlock_irqrestore(&wb->lock, flags);
+
+	queue_work(system_wq, &wb->work);
+	return 0;
+}
+
+EXPORT_SYMBOL(bbapi_write_behind);
+
+/**
+ * bbapi_wb_cancel() - drop a pending write, a newer one is executed now
+ * @group: IndexGroup of the write
+ * @offset: IndexOffset of the write
+ *
+ * You have to hold the lock on g_bbapi.mutex when calling this function!!!
+ */
+static void bbapi_wb_cancel(uint32_t group, uint32_t offset)
+{
+	struct bbapi_write_behind *const wb = &g_bbapi_wb;
+	unsigned long flags;
+	size_t i;
+
+	spin_lock_irqsave(&wb->lock, flags);
+	for (i = 0; i < ARRAY_SIZE(wb->slots); ++i) {
+		struct bbapi_wb_slot *const s = &wb->slots[i];
+
+		if (s->pending && s->group == group && s->offset == offset) {
+			s->pending = false;
+			wb->replaced++;
+			break;
+		}
+	}
+	spin_unlock_irqrestore(&wb->lock, flags);
+}
+
+/**
+ * bbapi_wb_oldest() - IndexGroup of the oldest pending write
+ * @group: set to the IndexGroup if a write is pending
+ *
+ * Return: false if no write is pending
+ */
+static bool bbapi_wb_oldest(uint32_t *group)
+{
+	struct bbapi_write_behind *const wb = &g_bbapi_wb;
+	const struct bbapi_wb_slot *oldest = NULL;
+	unsigned long flags;
+	size_t i;
+
+	spin_lock_irqsave(&wb->lock, flags);
+	for (i = 0; i < ARRAY_SIZE(wb->slots); ++i) {
+		const struct bbapi_wb_slot *const s = &wb->slots[i];
+
+		if (s->pending && (!oldest || s->seq < oldest->seq)) {
+			oldest = s;
+		}
+	}
+	if (oldest) {
+		*group = oldest->group;
+	}
+	spin_unlock_irqrestore(&wb->lock, flags);
+	return oldest != NULL;
+}
+
+/**
+ * bbapi_wb_pop() - move the oldest pending write into g_bbapi_wb.buf
+ *
+ * Writes are only popped with g_bbapi.mutex held. Otherwise a synchronous
+ * write to the same target could pass a popped write and be overwritten
+ * with the older value.
+ *
+ * Return: false if no write is pending
+ */
+static bool bbapi_wb_pop(void)
+{
+	struct bbapi_write_behind *const wb = &g_bbapi_wb;
+	struct bbapi_wb_slot *oldest = NULL;
+	unsigned long flags;
+	size_t i;
+
+	spin_lock_irqsave(&wb->lock, flags);
+	for (i = 0; i < ARRAY_SIZE(wb->slots); ++i) {
+		struct bbapi_wb_slot *const s = &wb->slots[i];
+
+		if (s->pending && (!oldest || s->seq < oldest->seq)) {
+			oldest = s;
+		}
+	}
+	if (oldest) {
+		wb->buf.group = oldest->group;
+		wb->buf.offset = oldest->offset;
+		wb->buf.size = oldest->size;
+		memcpy(wb->buf.data, oldest->data, oldest->size);
+		oldest->pending = false;
+	}
+	spin_unlock_irqrestore(&wb->lock, flags);
+	return oldest != NULL;
+}
+
+/**
+ * bbapi_wb_work() - execute pending writes under a single lock hold
+ *
+ * At most BBAPI_WRITE_BEHIND_SLOTS writes are executed per run, so a
+ * steady stream of submissions can't keep the BIOS lock. Writes submitted
+ * meanwhile have queued the work again.
+ */
+static void bbapi_wb_work(struct work_struct *work)
+{
+	struct bbapi_write_behind *const wb = &g_bbapi_wb;
+	struct bbapi_wb_slot *const x = &wb->buf;
+	uint32_t group;
+	size_t i;
+
+	if (!bbapi_wb_oldest(&group)) {
+		return;
+	}
+	bbapi_throttle(group, NULL);
+	bbapi_lock(NULL);
+	for (i = 0; i < BBAPI_WRITE_BEHIND_SLOTS && bbapi_wb_pop(); ++i) {
+		const struct bbapi_struct cmd = {
+			.nIndexGroup = x->group,
+			.nIndexOffset = x->offset,
+			.nInBufferSize = x->size,
+		};
+		uint32_t bytes_written = 0;
+		unsigned int status;
+
+		if (bbapi_quiesce_rejects(x->group)) {
+			wb->dropped++;
+			continue;
+		}
+		status = __bbapi_call_retry(x->data, NULL, g_bbapi.entry, &cmd,
+					    &bytes_written,
+					    (unsigned long)bbapi_wb_work, NULL);
+		wb->flushed++;
+		if (status) {
+			wb->failed++;
+			pr_debug("%s(0x%x:0x%x) failed with: 0x%x\n", __func__,
+				 cmd.nIndexGroup, cmd.nIndexOffset, status);
+		}
+	}
+	bbapi_unlock();
+}
+
+/**
+ * struct bbapi_poll_scheduler - executes all registered polls from one work
+ * @lock: protects @polls and the private members of struct bbapi_poll,
+ *        it is not held during BIOS calls and completion callbacks
+ * @polls: list of registered struct bbapi_poll
+ * @work: executes all due polls, scheduled for the earliest deadline
+ * @idle: woken when @work is done with the polls it executed
+ * @wakeups: number of times @work found at least one due poll
+ * @batches: number of polls executed
+ */
+struct bbapi_poll_scheduler {
+	struct mutex lock;
+	struct list_head polls;
+	struct delayed_work work;
+	wait_queue_head_t idle;
+	u64 wakeups;
+	u64 batches;
+};
+
+static struct bbapi_poll_scheduler g_bbapi_polls;
+
+/**
+ * You have to hold g_bbapi_polls.lock when calling this function!!!
+ */
+static void bbapi_poll_schedule(u64 now)
+{
+	const struct bbapi_poll *p;
+	u64 next = U64_MAX;
+
+	list_for_each_entry(p, &g_bbapi_polls.polls, node) {
+		next = min(next, p->next);
+	}
+	if (next == U64_MAX) {
+		return;
+	}
+	next = (next > now) ? next - now : 0;
+	mod_delayed_work(system_wq, &g_bbapi_polls.work,
+			 usecs_to_jiffies(DIV_ROUND_UP_ULL(next, NSEC_PER_USEC)));
+}
+
+static bool bbapi_poll_due(const struct bbapi_poll *p, u64 now)
+{
+	return p->next <= now + (u64)p->slack_ms * NSEC_PER_MSEC;
+}
+
+static bool bbapi_poll_critical(const struct bbapi_poll *p)
+{
+	size_t i;
+
+	for (i = 0; i < p->num; ++i) {
+		if (!bbapi_is_critical(p->xfers[i].group)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/**
+ * bbapi_poll_work() - execute all polls which are due or within their slack
+ *
+ * The due polls are collected under g_bbapi_polls.lock, their BIOS calls
+ * share a single acquisition of the BIOS lock afterwards. Completion
+ * callbacks run after the BIOS lock was released. Neither runs with
+ * g_bbapi_polls.lock held, so (un)registration never waits for the BIOS.
+ * bbapi_poll_unregister() waits for polls marked running instead.
+ * In quiesce mode or during a cool-down of the jitter guard polls with
+ * non-critical calls are deferred to their next period.
+ */
+static void bbapi_poll_work(struct work_struct *work)
+{
+	const bool quiesced = READ_ONCE(g_bbapi_quiesced);
+	struct bbapi_poll *p, *tmp;
+	LIST_HEAD(due);
+	bool throttled;
+	u64 now;
+	u64 runs = 0;
+
+	mutex_lock(&g_bbapi_polls.lock);
+	now = ktime_get_ns();
+	throttled = bbapi_guard_active(now);
+	list_for_each_entry(p, &g_bbapi_polls.polls, node) {
+		const u64 period = (u64)p->period_ms * NSEC_PER_MSEC;
+
+		if (!bbapi_poll_due(p, now)) {
+			continue;
+		}
+		p->next += period;
+		if (p->next <= now) {
+			p->next = now + period;
+		}
+		if ((quiesced || throttled) && !bbapi_poll_critical(p)) {
+			atomic64_inc(quiesced ? &g_bbapi_quiesce_deferred :
+				     &g_bbapi_guard.deferred);
+			continue;
+		}
+		p->running = true;
+		list_add_tail(&p->run, &due);
+	}
+	mutex_unlock(&g_bbapi_polls.lock);
+
+	if (!list_empty(&due)) {
+		bbapi_lock(NULL);
+		list_for_each_entry(p, &due, run) {
+			bbapi_rw_multi_mutexed(p->xfers, p->num,
+					       (unsigned long)p->complete);
+		}
+		bbapi_unlock();
+		list_for_each_entry(p, &due, run) {
+			if (p->complete) {
+				p->complete(p);
+			}
+			runs++;
+		}
+	}
+
+	mutex_lock(&g_bbapi_polls.lock);
+	if (runs) {
+		g_bbapi_polls.wakeups++;
+		g_bbapi_polls.batches += runs;
+	}
+	list_for_each_entry_safe(p, tmp, &due, run) {
+		list_del(&p->run);
+		p->runs++;
+		/* last access, @p may be freed after this */
+		smp_store_release(&p->running, false);
+	}
+	bbapi_poll_schedule(ktime_get_ns());
+	mutex_unlock(&g_bbapi_polls.lock);
+	wake_up_all(&g_bbapi_polls.idle);
+}
+
+/**
+ * bbapi_poll_register() - execute BIOS calls periodically
+ * @poll: description of the BIOS calls and their period, has to stay valid
+ *        until bbapi_poll_unregister() returns
+ *
+ * The first execution happens one period after registration.
+ *
+ * Return: 0 for success, -EINVAL if @poll has no calls or no period
+ */
+int bbapi_poll_register(struct bbapi_poll *const poll)
+{
+	u64 now;
+
+	if (!poll->num || !poll->period_ms) {
+		return -EINVAL;
+	}
+	mutex_lock(&g_bbapi_polls.lock);
+	now = ktime_get_ns();
+	poll->next = now + (u64)poll->period_ms * NSEC_PER_MSEC;
+	poll->runs = 0;
+	poll->running = false;
+	list_add_tail(&poll->node, &g_bbapi_polls.polls);
+	bbapi_poll_schedule(now);
+	mutex_unlock(&g_bbapi_polls.lock);
+	return 0;
+}
+
+EXPORT_SYMBOL(bbapi_poll_register);
+
+/**
+ * bbapi_poll_unregister() - stop executing a poll
+ * @poll: poll registered with bbapi_poll_register()
+ *
+ * After this function returns @poll->complete is no longer called and
+ * @poll is no longer accessed. Called from @poll->complete itself, it
+ * only stops future executions.
+ */
+void bbapi_poll_unregister(struct bbapi_poll *const poll)
+{
+	mutex_lock(&g_bbapi_polls.lock);
+	list_del(&poll->node);
+	mutex_unlock(&g_bbapi_polls.lock);
+	if (current_work() != &g_bbapi_polls.work.work) {
+		wait_event(g_bbapi_polls.idle,
+			   !smp_load_acquire(&poll->running));
+	}
+}
+
+EXPORT_SYMBOL(bbapi_poll_unregister);
+
+int bbapi_board_is(const char *const boardname)
+{
+	char board[CXPWRSUPP_MAX_DISPLAY_LINE] = { 0 };
+
+	bbapi_read(BIOSIGRP_GENERAL, BIOSIOFFS_GENERAL_GETBOARDNAME, &board,
+		   sizeof(board) - 1);
+	return 0 == strncmp(board, boardname, sizeof(board));
+}
+
+EXPORT_SYMBOL(bbapi_board_is);
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 8, 0)
+#include <linux/kprobes.h>
+static struct kprobe kp = {
+	.symbol_name = "kallsyms_lookup_name"
+};
+
+typedef unsigned long (*kallsyms_lookup_name_t)(const char *name);
+kallsyms_lookup_name_t fcn_kallsyms_lookup_name;
+
+typedef void *(*fcn_vmalloc_node_range_t)(unsigned long size, unsigned long align,
+		unsigned long start, unsigned long end, gfp_t gfp_mask,
+		pgprot_t prot, unsigned long vm_flags, int node,
+		const void *caller);
+fcn_vmalloc_node_range_t fcn_vmalloc_node_range;
+#endif
+
+/**
+ * bbapi_free_bios() - release the BIOS copy allocated by bbapi_copy_bios()
+ * @bbapi: bbapi_object with a valid BIOS copy
+ */
+static void bbapi_free_bios(struct bbapi_object *bbapi)
+{
+	vfree(bbapi->memory);
+}
+
+/**
+ * bbapi_copy_bios() - Copy BIOS from SPI flash into RAM
+ * @bbapi: pointer to a not initialized bbapi_object
+ * @pos: pointer to the BIOS identifier string in flash
+ *
+ * We use BIOS shadowing to increase realtime performance.
+ * The BIOS identifier string is followed by the 32-Bit BIOS API
+ * function offset. This offset is the location of the BIOS API entry
+ * function and is located at most 4096 bytes in front of the
+ * BIOS memory end. So we calculate the size of the BIOS and copy it
+ * from SPI Flash into RAM.
+ * Accessing the BIOS in ROM while running realtime applications would
+ * otherwise have bad effects on the realtime behaviour.
+ *
+ * Note: PAGE_KERNEL_EXEC omits the "no execute bit" exception
+ *
+ * Return: 0 for success, -ENOMEM if the allocation of kernel memory fails
+ */
+static int __init bbapi_copy_bios(struct bbapi_object *bbapi,
+				  uint8_t __iomem * pos)
+{
+	const uint32_t offset = ioread32(pos + 8);
+	const size_t size = offset + 4096;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 8, 0)
+	bbapi->memory = fcn_vmalloc_node_range(size, 1, VMALLOC_START, VMALLOC_END,
+			GFP_KERNEL, PAGE_KERNEL_EXEC, 0, NUMA_NO_NODE, __builtin_return_address(0));
+#else
+	bbapi->memory = __vmalloc(size, GFP_KERNEL, PAGE_KERNEL_EXEC);
+#endif
+	if (bbapi->memory == NULL) {
+		pr_info("__vmalloc for Beckhoff BIOS API failed\n");
+		return -ENOMEM;
+	}
+	memcpy_fromio(bbapi->memory, pos, size);
+	bbapi->size = size;
+	bbapi->entry = bbapi->memory + offset;
+	return 0;
+}
+
+/**
+ * bbapi_find_bios() - Find BIOS in SPI flash and copy it into RAM
+ * @bbapi: pointer to a not initialized bbapi_object
+ *
+ * If successful bbapi->memory and bbapi->entry point to the bios in RAM
+ *
+ * Return: 0 if the bios was successfully copied into RAM
+ */
+static int __init bbapi_find_bios(struct bbapi_object *bbapi)
+{
+	static const size_t STEP_SIZE = 0x10;
+
+	// Try to remap IO Memory to search the BIOS API in the memory
+	if (g_bbapi_search_area > BBIOSAPI_SIGNATURE_SEARCH_AREA) {
+		pr_warn("Search area too big\n");
+		return -EFAULT;
+	}
+	uint8_t __iomem *const start = ioremap(BBIOSAPI_SIGNATURE_PHYS_START_ADDR,
+					       g_bbapi_search_area);
+	const uint8_t __iomem *const end = start + g_bbapi_search_area;
+	int result = -EFAULT;
+	uint8_t __iomem *pos;
+	size_t off;
+
+	if (start == NULL) {
+		pr_warn("Mapping memory search area for BIOS API failed\n");
+		return -ENOMEM;
+	}
+	// Search through the remapped memory and look for the BIOS API String
+	for (off = 0; off < STEP_SIZE; ++off) {
+		for (pos = start + off; pos <= end - STEP_SIZE; pos += STEP_SIZE) {
+			const uint32_t low = ioread32(pos);
+			const uint32_t high = ioread32(pos + 4);
+			const uint64_t lword = ((uint64_t) high << 32 | low);
+			if (BBIOSAPI_SIGNATURE == lword) {
+				result = bbapi_copy_bios(bbapi, pos);
+				pr_info
+				    ("BIOS found and copied from: %p + 0x%zx | %zu\n",
+				     start, pos - start, off);
+				goto cleanup;
+			}
+		}
+	}
+cleanup:
+	iounmap(start);
+	return result;
+}
+
+/**
+ * You have to hold the lock on bbapi->mutex when calling this function!!!
+ *
+ *
+ * A busy BIOS is retried within the constraints of @wait, if they don't
+ * allow to wait long enough -EAGAIN, -EINTR or -ETIMEDOUT is returned.
+ */
+static int bbapi_ioctl_mutexed(struct bbapi_object *const bbapi,
+			       const struct bbapi_struct *const cmd,
+			       struct bbapi_wait *wait)
+{
+	unsigned int written = 0;
+	unsigned int ret;
+
+	if (cmd->nInBufferSize > sizeof(bbapi->in)) {
+		pr_err("%s(): nInBufferSize invalid\n", __FUNCTION__);
+		return -EINVAL;
+	}
+	if (cmd->nOutBufferSize > sizeof(bbapi->out)) {
+		pr_err("%s(): nOutBufferSize: %d invalid\n", __FUNCTION__,
+		       cmd->nOutBufferSize);
+		return -EINVAL;
+	}
+	// BIOS can operate on kernel space buffers only -> make a temporary copy
+	if (copy_from_user(bbapi->in, cmd->pInBuffer, cmd->nInBufferSize)) {
+		pr_err("%s(): copy_from_user() failed\n", __FUNCTION__);
+		return -EFAULT;
+	}
+	// Call the BIOS API
+	ret = bbapi_call_retry(bbapi->in, bbapi->out, bbapi->entry, cmd, &written,
+			       0, wait);
+	if (wait->result) {
+		return wait->result;
+	}
+	if (ret) {
+		pr_debug("%s(0x%x:0x%x) failed with: 0x%x\n", __func__,
+		         cmd->nIndexGroup, cmd->nIndexOffset, ret);
+		return -(ret | BIOSAPIERR_OFFSET);
+	}
+	// Copy the BIOS output to the output buffer in user space
+	if (copy_to_user(cmd->pOutBuffer, bbapi->out, written)) {
+		pr_err("%s(): copy_to_user() failed\n", __FUNCTION__);
+		return -EFAULT;
+	}
+
+	if (cmd->pBytesReturned) {
+		put_user(written, cmd->pBytesReturned);
+	}
+	return 0;
+}
+
+/**
+ * bbapi_ioctl_coalesced() - execute a read without input data on behalf of
+ *                           user space, see bbapi_read_coalesced()
+ */
+static int bbapi_ioctl_coalesced(const struct bbapi_struct *const cmd,
+				 struct bbapi_wait *wait)
+{
+	char out[BBAPI_BUFFER_SIZE];
+	uint32_t written = 0;
+	unsigned int status;
+	int ret;
+
+	if (cmd->nOutBufferSize > sizeof(out)) {
+		pr_err("%s(): nOutBufferSize: %d invalid\n", __FUNCTION__,
+		       cmd->nOutBufferSize);
+		return -EINVAL;
+	}
+	ret = bbapi_read_coalesced(cmd->nIndexGroup, cmd->nIndexOffset, out,
+				   cmd->nOutBufferSize, &written, &status, 0,
+				   wait);
+	if (ret) {
+		return ret;
+	}
+	if (status) {
+		return -(status | BIOSAPIERR_OFFSET);
+	}
+	if (copy_to_user(cmd->pOutBuffer, out, written)) {
+		pr_err("%s(): copy_to_user() failed\n", __FUNCTION__);
+		return -EFAULT;
+	}
+	if (cmd->pBytesReturned) {
+		put_user(written, cmd->pBytesReturned);
+	}
+	return 0;
+}
+
+static int bbapi_ioctl_persist(unsigned long arg)
+{
+	struct bbapi_persist persist;
+
+	if (copy_from_user(&persist, (const void __user *)arg, sizeof(persist))) {
+		pr_err("copy_from_user failed\n");
+		return -EFAULT;
+	}
+	if (persist.nReserved) {
 		return -EINVAL;
 	}
+	return bbapi_persist(persist.data, persist.nSize);
+}
+
+/**
+ * bbapi_ioctl_copy_request() - copy and validate a bbapi_struct from user space
+ * @cmd: BBAPI_CMD or BBAPI_CMD_LEGACY
+ * @arg: user space pointer to the request
+ * @bbstruct: destination for the request
+ * @wait: updated with the deadline of the optional struct bbapi_mode
+ */
+static int bbapi_ioctl_copy_request(unsigned int cmd, unsigned long arg,
+				    struct bbapi_struct *bbstruct,
+				    struct bbapi_wait *wait)
+{
+	size_t size = sizeof(*bbstruct);
+
 	// Check if IOCTL CMD matches BBAPI Driver Command
 #ifdef BBAPI_CMD_LEGACY
 	if (cmd == BBAPI_CMD_LEGACY) {
-		size -= sizeof(bbstruct.pBytesReturned) + sizeof(bbstruct.pMode);
-		bbstruct.pBytesReturned = NULL;
-		bbstruct.pMode = NULL;
+		size -= sizeof(bbstruct->pBytesReturned) + sizeof(bbstruct->pMode);
+		bbstruct->pBytesReturned = NULL;
+		bbstruct->pMode = NULL;
 	} else
 #endif
-	if (cmd != BBAPI_CMD) {
-		pr_info("Wrong Command\n");
+	if (cmd != BBAPI_CMD) {
+		pr_info("Wrong Command\n");
+		return -EINVAL;
+	}
+	// Copy data (BBAPI struct) from User Space to Kernel Module - if it fails, return error
+	if (copy_from_user
+	    (bbstruct, (const void __user *)arg, size)) {
+		pr_err("copy_from_user failed\n");
+		return -EINVAL;
+	}
+	// pMode optionally points to additional request attributes
+	if (bbstruct->pMode) {
+		struct bbapi_mode mode;
+
+		if (copy_from_user(&mode, bbstruct->pMode, sizeof(mode))) {
+			pr_err("copy_from_user failed\n");
+			return -EFAULT;
+		}
+		if (mode.nFlags || mode.nReserved) {
+			pr_info("Reserved fields in pMode have to be zero!\n");
+			return -EINVAL;
+		}
+		wait->deadline = mode.nDeadline;
+	}
+
+	if (bbstruct->nIndexOffset >= 0xB0) {
+		pr_info("cmd: 0x%x : 0x%x not available from user mode\n",
+			bbstruct->nIndexGroup, bbstruct->nIndexOffset);
+		return -EACCES;
+	}
+	return 0;
+}
+
+/**
+ * bbapi_ioctl_request() - execute a validated request of user space
+ */
+static int bbapi_ioctl_request(const struct bbapi_struct *const bbstruct,
+			       struct bbapi_wait *wait)
+{
+	int result;
+
+	if (bbapi_quiesce_rejects(bbstruct->nIndexGroup)) {
+		return -EBUSY;
+	}
+	result = bbapi_throttle(bbstruct->nIndexGroup, wait);
+	if (result) {
+		return result;
+	}
+
+	if (!wait->nonblock &&
+	    bbapi_may_coalesce(bbstruct->nIndexGroup, bbstruct->nIndexOffset,
+			       bbstruct->nInBufferSize,
+			       bbstruct->nOutBufferSize)) {
+		return bbapi_ioctl_coalesced(bbstruct, wait);
+	}
+
+	result = bbapi_lock(wait);
+	if (result) {
+		return result;
+	}
+	if (bbapi_quiesce_rejects(bbstruct->nIndexGroup)) {
+		bbapi_unlock();
+		return -EBUSY;
+	}
+	result = bbapi_ioctl_mutexed(&g_bbapi, bbstruct, wait);
+	bbapi_unlock();
+	return result;
+}
+
+#define BBAPI_MAX_HANDLES 256
+
+/**
+ * struct bbapi_file - per file context of /dev/bbapi
+ * @lock: protects all other members
+ * @handles: request templates registered with BBAPI_CMD_PREPARE
+ * @bound: @group was set with BBAPI_CMD_BIND
+ * @group: IndexGroup of read() and write()
+ */
+struct bbapi_file {
+	struct mutex lock;
+	struct idr handles;
+	bool bound;
+	uint32_t group;
+};
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 0, 0)
+#define bbapi_access_ok(type, addr, size) access_ok(addr, size)
+#else
+#define bbapi_access_ok(type, addr, size) access_ok(type, addr, size)
+#endif
+
+/**
+ * bbapi_ioctl_prepare() - register a request template
+ *
+ * The template is validated once, later executions with BBAPI_CMD_EXECUTE
+ * skip copying and checking the descriptor. The user buffers are checked
+ * with access_ok() but not pinned, their content is still copied on every
+ * execution, as the BIOS operates on kernel buffers only.
+ *
+ * Return: a handle > 0 or a negative errno
+ */
+static int bbapi_ioctl_prepare(struct bbapi_file *ctx, unsigned long arg)
+{
+	struct bbapi_wait wait = { };
+	struct bbapi_struct *tmpl;
+	int result;
+
+	tmpl = kmalloc(sizeof(*tmpl), GFP_KERNEL);
+	if (!tmpl) {
+		return -ENOMEM;
+	}
+	result = bbapi_ioctl_copy_request(BBAPI_CMD, arg, tmpl, &wait);
+	if (result) {
+		goto free;
+	}
+	result = -EINVAL;
+	if (tmpl->pMode) {
+		pr_info("Prepared requests don't support pMode\n");
+		goto free;
+	}
+	if (tmpl->nInBufferSize > BBAPI_BUFFER_SIZE ||
+	    tmpl->nOutBufferSize > BBAPI_BUFFER_SIZE) {
+		goto free;
+	}
+	result = -EFAULT;
+	if (!bbapi_access_ok(VERIFY_READ, tmpl->pInBuffer, tmpl->nInBufferSize) ||
+	    !bbapi_access_ok(VERIFY_WRITE, tmpl->pOutBuffer, tmpl->nOutBufferSize) ||
+	    (tmpl->pBytesReturned &&
+	     !bbapi_access_ok(VERIFY_WRITE, tmpl->pBytesReturned,
+			      sizeof(*tmpl->pBytesReturned)))) {
+		goto free;
+	}
+
+	mutex_lock(&ctx->lock);
+	result = idr_alloc(&ctx->handles, tmpl, 1, BBAPI_MAX_HANDLES + 1,
+			   GFP_KERNEL);
+	mutex_unlock(&ctx->lock);
+	if (result < 0) {
+		goto free;
+	}
+	return result;
+free:
+	kfree(tmpl);
+	return result;
+}
+
+static int bbapi_ioctl_execute(struct bbapi_file *ctx, struct bbapi_wait *wait,
+			       unsigned long handle)
+{
+	const struct bbapi_struct *tmpl;
+	struct bbapi_struct bbstruct;
+
+	mutex_lock(&ctx->lock);
+	tmpl = idr_find(&ctx->handles, handle);
+	if (tmpl) {
+		bbstruct = *tmpl;
+	}
+	mutex_unlock(&ctx->lock);
+	if (!tmpl) {
+		return -ENOENT;
+	}
+	return bbapi_ioctl_request(&bbstruct, wait);
+}
+
+/**
+ * bbapi_ioctl_execute_list() - execute prepared requests under one lock hold
+ *
+ * Execution stops at the first failing request.
+ */
+static int bbapi_ioctl_execute_list(struct bbapi_file *ctx,
+				    struct bbapi_wait *wait, unsigned long arg)
+{
+	uint32_t handles[BBAPI_MAX_HANDLE_LIST];
+	struct bbapi_handle_list list;
+	struct bbapi_struct *reqs;
+	int result = 0;
+	size_t i;
+
+	if (copy_from_user(&list, (const void __user *)arg, sizeof(list))) {
+		return -EFAULT;
+	}
+	if (list.nReserved || list.nCount > BBAPI_MAX_HANDLE_LIST) {
 		return -EINVAL;
 	}
-	// Copy data (BBAPI struct) from User Space to Kernel Module - if it fails, return error
-	if (copy_from_user
-	    (&bbstruct, (const void __user *)arg, size)) {
-		pr_err("copy_from_user failed\n");
+	if (copy_from_user(handles, list.pHandles,
+			   list.nCount * sizeof(handles[0]))) {
+		return -EFAULT;
+	}
+	reqs = kmalloc_array(list.nCount, sizeof(*reqs), GFP_KERNEL);
+	if (!reqs) {
+		return -ENOMEM;
+	}
+
+	mutex_lock(&ctx->lock);
+	for (i = 0; i < list.nCount; ++i) {
+		const struct bbapi_struct *const tmpl =
+		    idr_find(&ctx->handles, handles[i]);
+
+		if (!tmpl) {
+			result = -ENOENT;
+			break;
+		}
+		reqs[i] = *tmpl;
+	}
+	mutex_unlock(&ctx->lock);
+	for (i = 0; !result && i < list.nCount; ++i) {
+		result = bbapi_throttle(reqs[i].nIndexGroup, wait);
+	}
+	if (result) {
+		goto free;
+	}
+
+	result = bbapi_lock(wait);
+	if (result) {
+		goto free;
+	}
+	for (i = 0; !result && i < list.nCount; ++i) {
+		if (bbapi_quiesce_rejects(reqs[i].nIndexGroup)) {
+			result = -EBUSY;
+		} else {
+			result = bbapi_ioctl_mutexed(&g_bbapi, &reqs[i], wait);
+		}
+	}
+	bbapi_unlock();
+free:
+	kfree(reqs);
+	return result;
+}
+
+static int bbapi_ioctl_release(struct bbapi_file *ctx, unsigned long handle)
+{
+	struct bbapi_struct *tmpl;
+
+	mutex_lock(&ctx->lock);
+	tmpl = idr_remove(&ctx->handles, handle);
+	mutex_unlock(&ctx->lock);
+	if (!tmpl) {
+		return -ENOENT;
+	}
+	kfree(tmpl);
+	return 0;
+}
+
+/**
+ * bbapi_request_kernel() - execute a request of user space on kernel buffers
+ * @cmd: IndexGroup, IndexOffset and buffer sizes, the pointers are ignored
+ * @in: @cmd->nInBufferSize bytes of input
+ * @out: buffer for @cmd->nOutBufferSize bytes of output, may equal @in
+ * @bytes_written: number of bytes written to @out
+ * @status: status returned by the BIOS, only valid if 0 is returned
+ * @wait: wait constraints of the caller
+ *
+ * The BIOS status is kept apart from the errno, because both ranges
+ * overlap in legacy mode (BIOSAPIERR_OFFSET == 0).
+ *
+ * Return: 0 or a negative errno
+ */
+static int bbapi_request_kernel(const struct bbapi_struct *const cmd,
+				void *in, void *out, uint32_t *bytes_written,
+				unsigned int *status, struct bbapi_wait *wait)
+{
+	int result;
+
+	*status = 0;
+	if (bbapi_quiesce_rejects(cmd->nIndexGroup)) {
+		return -EBUSY;
+	}
+	result = bbapi_throttle(cmd->nIndexGroup, wait);
+	if (result) {
+		return result;
+	}
+	if (!wait->nonblock &&
+	    bbapi_may_coalesce(cmd->nIndexGroup, cmd->nIndexOffset,
+			       cmd->nInBufferSize, cmd->nOutBufferSize)) {
+		return bbapi_read_coalesced(cmd->nIndexGroup, cmd->nIndexOffset,
+					    out, cmd->nOutBufferSize,
+					    bytes_written, status, 0, wait);
+	}
+
+	result = bbapi_lock(wait);
+	if (result) {
+		return result;
+	}
+	if (bbapi_quiesce_rejects(cmd->nIndexGroup)) {
+		bbapi_unlock();
+		return -EBUSY;
+	}
+	*status = bbapi_call_retry(in, g_bbapi.out, g_bbapi.entry, cmd,
+				   bytes_written, 0, wait);
+	*bytes_written = min_t(uint32_t, *bytes_written, cmd->nOutBufferSize);
+	memcpy(out, g_bbapi.out, *bytes_written);
+	bbapi_unlock();
+	return wait->result;
+}
+
+/**
+ * bbapi_ioctl_v2() - execute a struct bbapi_struct_v2 request
+ */
+static int bbapi_ioctl_v2(struct bbapi_wait *wait, unsigned long arg)
+{
+	struct bbapi_struct_v2 __user *const user = (void __user *)arg;
+	const size_t header = offsetof(struct bbapi_struct_v2, data);
+	struct bbapi_struct_v2 req;
+	struct bbapi_struct cmd = {};
+	uint32_t written = 0;
+	unsigned int status = 0;
+	int result;
+
+	BUILD_BUG_ON(sizeof(req.data) != BBAPI_BUFFER_SIZE);
+	if (copy_from_user(&req, user, header)) {
+		return -EFAULT;
+	}
+	if (req.nInBufferSize > sizeof(req.data) ||
+	    req.nOutBufferSize > sizeof(req.data) ||
+	    (req.nFlags & ~BBAPI_V2_WRITE_BEHIND) || req.nReserved) {
 		return -EINVAL;
 	}
-	// pMode is reserved for future use
-	if (bbstruct.pMode) {
-		pr_info("Setting pMode to nullptr is mandatory!\n");
+	if ((req.nFlags & BBAPI_V2_WRITE_BEHIND) && req.nOutBufferSize) {
 		return -EINVAL;
 	}
-
-	if (bbstruct.nIndexOffset >= 0xB0) {
+	if (req.nIndexOffset >= 0xB0) {
 		pr_info("cmd: 0x%x : 0x%x not available from user mode\n",
-			bbstruct.nIndexGroup, bbstruct.nIndexOffset);
+			req.nIndexGroup, req.nIndexOffset);
 		return -EACCES;
 	}
+	if (req.nInBufferSize &&
+	    copy_from_user(req.data, user->data, req.nInBufferSize)) {
+		return -EFAULT;
+	}
+	wait->deadline = req.nDeadline;
+	cmd.nIndexGroup = req.nIndexGroup;
+	cmd.nIndexOffset = req.nIndexOffset;
+	cmd.nInBufferSize = req.nInBufferSize;
+	cmd.nOutBufferSize = req.nOutBufferSize;
+
+	if (req.nFlags & BBAPI_V2_WRITE_BEHIND) {
+		result = bbapi_write_behind(req.nIndexGroup, req.nIndexOffset,
+					    req.data, req.nInBufferSize);
+	} else {
+		result = bbapi_request_kernel(&cmd, req.data, req.data,
+					      &written, &status, wait);
+	}
+	if (result) {
+		return result;
+	}
+	req.nStatus = status ? (status | BIOSAPIERR_OFFSET) : 0;
+	if (req.nStatus) {
+		written = 0;
+	}
+	req.nBytesReturned = written;
+	if (copy_to_user(user, &req, header + written)) {
+		return -EFAULT;
+	}
+	return 0;
+}
 
-	mutex_lock(&g_bbapi.mutex);
-	result = bbapi_ioctl_mutexed(&g_bbapi, &bbstruct);
-	mutex_unlock(&g_bbapi.mutex);
+static int bbapi_ioctl_bind(struct bbapi_file *ctx, unsigned long group)
+{
+	mutex_lock(&ctx->lock);
+	ctx->group = group;
+	ctx->bound = true;
+	mutex_unlock(&ctx->lock);
+	return 0;
+}
+
+/**
+ * bbapi_errno() - translate a BIOS status to an errno for read() and write()
+ * @status: BIOS status reported by bbapi_request_kernel(), not 0
+ */
+static int bbapi_errno(unsigned int status)
+{
+	switch (status | BIOSAPIERR_OFFSET) {
+	case BIOSAPI_SRVNOTSUPP:
+		return -EOPNOTSUPP;
+	case BIOSAPI_INVALIDSIZE:
+	case BIOSAPI_INVALIDPARM:
+		return -EINVAL;
+	case BIOSAPI_BUSY:
+		return -EBUSY;
+	default:
+		return -EIO;
+	}
+}
+
+/**
+ * bbapi_fd_cmd() - prepare a read() or write() of a file bound to a group
+ * @f: the file
+ * @pos: file offset used as IndexOffset
+ * @size: size of the read or write
+ * @cmd: IndexGroup and IndexOffset are set on success
+ *
+ * Return: 0 for success, -ENXIO if the file isn't bound to a group,
+ * -EINVAL or -EACCES if @pos or @size are not allowed for user space
+ */
+static int bbapi_fd_cmd(struct file *f, loff_t pos, size_t size,
+			struct bbapi_struct *cmd)
+{
+	struct bbapi_file *const ctx = f->private_data;
+	int result = 0;
+
+	if (size > BBAPI_BUFFER_SIZE || pos < 0) {
+		return -EINVAL;
+	}
+	if (pos >= 0xB0) {
+		return -EACCES;
+	}
+	mutex_lock(&ctx->lock);
+	if (!ctx->bound) {
+		result = -ENXIO;
+	} else {
+		cmd->nIndexGroup = ctx->group;
+		cmd->nIndexOffset = pos;
+	}
+	mutex_unlock(&ctx->lock);
 	return result;
 }
 
+/**
+ * bbapi_fd_read() - read IndexOffset *@ppos of the group bound to @f
+ *
+ * Return: number of bytes the BIOS returned or a negative errno
+ */
+static ssize_t bbapi_fd_read(struct file *f, char __user *buf, size_t size,
+			     loff_t *ppos)
+{
+	struct bbapi_wait wait = {
+		.nonblock = f->f_flags & O_NONBLOCK,
+		.interruptible = true,
+	};
+	struct bbapi_struct cmd = {};
+	char out[BBAPI_BUFFER_SIZE];
+	uint32_t written = 0;
+	unsigned int status;
+	int result;
+
+	if (!g_bbapi.entry) {
+		return -EINVAL;
+	}
+	result = bbapi_fd_cmd(f, *ppos, size, &cmd);
+	if (result) {
+		return result;
+	}
+	cmd.nOutBufferSize = size;
+	result = bbapi_request_kernel(&cmd, NULL, out, &written, &status,
+				      &wait);
+	if (result) {
+		return result;
+	}
+	if (status) {
+		return bbapi_errno(status);
+	}
+	if (copy_to_user(buf, out, written)) {
+		return -EFAULT;
+	}
+	++*ppos;
+	return written;
+}
+
+/**
+ * bbapi_fd_write() - write IndexOffset *@ppos of the group bound to @f
+ *
+ * Return: @size or a negative errno
+ */
+static ssize_t bbapi_fd_write(struct file *f, const char __user *buf,
+			      size_t size, loff_t *ppos)
+{
+	struct bbapi_wait wait = {
+		.nonblock = f->f_flags & O_NONBLOCK,
+		.interruptible = true,
+	};
+	struct bbapi_struct cmd = {};
+	char in[BBAPI_BUFFER_SIZE];
+	uint32_t written = 0;
+	unsigned int status;
+	int result;
+
+	if (!g_bbapi.entry) {
+		return -EINVAL;
+	}
+	result = bbapi_fd_cmd(f, *ppos, size, &cmd);
+	if (result) {
+		return result;
+	}
+	if (copy_from_user(in, buf, size)) {
+		return -EFAULT;
+	}
+	cmd.nInBufferSize = size;
+	result = bbapi_request_kernel(&cmd, in, NULL, &written, &status,
+				      &wait);
+	if (result) {
+		return result;
+	}
+	if (status) {
+		return bbapi_errno(status);
+	}
+	++*ppos;
+	return size;
+}
+
+/**
+ * bbapi_ioctl() - execute a BIOS call on behalf of user space
+ *
+ * If the file was opened with O_NONBLOCK the call never waits: it fails
+ * with -EAGAIN when another BIOS call (or its busy backoff) is in flight
+ * or when the BIOS reports busy.
+ * Otherwise waits can be interrupted by signals and are limited by the
+ * optional deadline in struct bbapi_mode, after which the request is
+ * dropped with -ETIMEDOUT.
+ */
+static long bbapi_ioctl(struct file *f, unsigned int cmd, unsigned long arg)
+{
+	struct bbapi_wait wait = {
+		.nonblock = f->f_flags & O_NONBLOCK,
+		.interruptible = true,
+	};
+	struct bbapi_struct bbstruct;
+	int result;
+
+	if (!g_bbapi.entry) {
+		pr_warn("%s(): not initialized.\n", __FUNCTION__);
+		return -EINVAL;
+	}
+
+	switch (cmd) {
+	case BBAPI_CMD_V2:
+		return bbapi_ioctl_v2(&wait, arg);
+	case BBAPI_CMD_PERSIST:
+		return bbapi_ioctl_persist(arg);
+	case BBAPI_CMD_PREPARE:
+		return bbapi_ioctl_prepare(f->private_data, arg);
+	case BBAPI_CMD_EXECUTE:
+		return bbapi_ioctl_execute(f->private_data, &wait, arg);
+	case BBAPI_CMD_EXECUTE_LIST:
+		return bbapi_ioctl_execute_list(f->private_data, &wait, arg);
+	case BBAPI_CMD_RELEASE:
+		return bbapi_ioctl_release(f->private_data, arg);
+	case BBAPI_CMD_BIND:
+		return bbapi_ioctl_bind(f->private_data, arg);
+	}
+
+	result = bbapi_ioctl_copy_request(cmd, arg, &bbstruct, &wait);
+	if (result) {
+		return result;
+	}
+	return bbapi_ioctl_request(&bbstruct, &wait);
+}
+
+static int bbapi_open(struct inode *i, struct file *f)
+{
+	struct bbapi_file *const ctx = kzalloc(sizeof(*ctx), GFP_KERNEL);
+
+	if (!ctx) {
+		return -ENOMEM;
+	}
+	mutex_init(&ctx->lock);
+	idr_init(&ctx->handles);
+	f->private_data = ctx;
+	return 0;
+}
+
 static int bbapi_release(struct inode *i, struct file *f)
 {
+	struct bbapi_file *const ctx = f->private_data;
+	struct bbapi_struct *tmpl;
+	int handle;
+
+	idr_for_each_entry(&ctx->handles, tmpl, handle) {
+		kfree(tmpl);
+	}
+	idr_destroy(&ctx->handles);
+	kfree(ctx);
 	return 0;
 }
 
 static struct file_operations file_ops = {
 	.owner = THIS_MODULE,
+	.open = bbapi_open,
+	.read = bbapi_fd_read,
+	.write = bbapi_fd_write,
+	.llseek = default_llseek,
 	.unlocked_ioctl = bbapi_ioctl,
 	.release = bbapi_release,
 };
 
-static void __init update_display(void)
+static void update_display(void)
 {
 	char line[CXPWRSUPP_MAX_DISPLAY_LINE];
 	uint8_t enable = 0xff;
@@ -419,27 +2672,170 @@ static struct platform_device bbapi_sups = {
 	.dev = {.release = dev_release_nop},
 };
 
-inline static bool bbapi_supports(uint32_t group, uint32_t offset)
+inline static bool bbapi_supports(uint32_t group, uint32_t offset)
+{
+
+	switch (-bbapi_read(group, offset, NULL, 0)) {
+	case BIOSAPI_INVALIDSIZE:
+	case BIOSAPI_INVALIDPARM:
+		return true;
+	default:
+		return false;
+	}
+}
+
+#define bbapi_supports_display() \
+	bbapi_supports(BIOSIGRP_CXPWRSUPP, BIOSIOFFS_CXPWRSUPP_ENABLEBACKLIGHT)
+
+#define bbapi_supports_power() \
+	bbapi_supports(BIOSIGRP_CXPWRSUPP, BIOSIOFFS_CXPWRSUPP_GETTYPE)
+
+#define bbapi_supports_sups() \
+	(bbapi_supports(BIOSIGRP_SUPS, BIOSIOFFS_SUPS_GPIO_PIN_EX) \
+	 || bbapi_supports(BIOSIGRP_SUPS, BIOSIOFFS_SUPS_GPIO_PIN))
+
+static bool g_bbapi_map_cache = true;
+module_param_named(map_cache, g_bbapi_map_cache, bool, 0);
+MODULE_PARM_DESC(map_cache, "Keep memory mappings requested by the BIOS alive for reuse (default: true)");
+
+#define BBAPI_MAP_CACHE_SIZE 8	// number of long-lived mappings for the BIOS
+
+/**
+ * struct bbapi_mapping - long-lived mapping requested by the BIOS
+ * @phys: page aligned physical start address
+ * @size: page aligned size of the mapping
+ * @virt: virtual address of @phys, NULL for an unused slot
+ * @refcount: number of BIOS MAPMEM requests not yet followed by UNMAPMEM
+ * @last_used: value of the cache clock on the last MAPMEM hit for LRU eviction
+ */
+struct bbapi_mapping {
+	phys_addr_t phys;
+	size_t size;
+	void __iomem *virt;
+	unsigned int refcount;
+	unsigned long last_used;
+};
+
+/**
+ * Some BIOS functions map SMBus or EC registers on each call. Instead of
+ * paying for ioremap()/iounmap() and the resulting TLB shootdown IPIs every
+ * time, we keep the mappings and hand them out again. The BIOS calls the
+ * MAPMEM/UNMAPMEM callbacks only from within a BIOS call, so the cache is
+ * protected by g_bbapi.mutex.
+ */
+static struct bbapi_map_cache {
+	struct bbapi_mapping entries[BBAPI_MAP_CACHE_SIZE];
+	unsigned long clock;
+	u64 map_calls;
+	u64 unmap_calls;
+	u64 hits;
+	u64 ioremaps;
+	u64 iounmaps;
+	u64 evictions;
+} g_bbapi_maps;
+
+static void __iomem *bbapi_map(phys_addr_t phys, size_t size)
+{
+	struct bbapi_map_cache *const cache = &g_bbapi_maps;
+	const phys_addr_t start = phys & PAGE_MASK;
+	const size_t len = PAGE_ALIGN(phys + size) - start;
+	struct bbapi_mapping *victim = NULL;
+	void __iomem *virt;
+	size_t i;
+
+	cache->map_calls++;
+	if (!g_bbapi_map_cache) {
+		cache->ioremaps++;
+		return ioremap(phys, size);
+	}
+
+	for (i = 0; i < ARRAY_SIZE(cache->entries); ++i) {
+		struct bbapi_mapping *const m = &cache->entries[i];
+
+		if (m->virt && m->phys <= phys
+		    && phys + size <= m->phys + m->size) {
+			cache->hits++;
+			m->refcount++;
+			m->last_used = ++cache->clock;
+			return m->virt + (phys - m->phys);
+		}
+
+		if (m->refcount) {
+			continue;
+		}
+		if (!victim || (victim->virt
+				&& (!m->virt
+				    || m->last_used < victim->last_used))) {
+			victim = m;
+		}
+	}
+
+	cache->ioremaps++;
+	if (!victim) {
+		/* all slots in use -> fall back to a short-lived mapping */
+		return ioremap(phys, size);
+	}
+
+	virt = ioremap(start, len);
+	if (!virt) {
+		return NULL;
+	}
+
+	if (victim->virt) {
+		cache->evictions++;
+		cache->iounmaps++;
+		iounmap(victim->virt);
+	}
+	victim->phys = start;
+	victim->size = len;
+	victim->virt = virt;
+	victim->refcount = 1;
+	victim->last_used = ++cache->clock;
+	return virt + (phys - start);
+}
+
+static void bbapi_unmap(void __iomem *virt)
 {
+	struct bbapi_map_cache *const cache = &g_bbapi_maps;
+	size_t i;
 
-	switch (-bbapi_read(group, offset, NULL, 0)) {
-	case BIOSAPI_INVALIDSIZE:
-	case BIOSAPI_INVALIDPARM:
-		return true;
-	default:
-		return false;
+	cache->unmap_calls++;
+	for (i = 0; i < ARRAY_SIZE(cache->entries); ++i) {
+		struct bbapi_mapping *const m = &cache->entries[i];
+
+		if (m->virt && m->virt <= virt && virt < m->virt + m->size) {
+			if (m->refcount) {
+				m->refcount--;
+			}
+			return;
+		}
 	}
+	cache->iounmaps++;
+	iounmap(virt);
 }
 
-#define bbapi_supports_display() \
-	bbapi_supports(BIOSIGRP_CXPWRSUPP, BIOSIOFFS_CXPWRSUPP_ENABLEBACKLIGHT)
+static void bbapi_map_cache_flush(void)
+{
+	struct bbapi_map_cache *const cache = &g_bbapi_maps;
+	size_t i;
 
-#define bbapi_supports_power() \
-	bbapi_supports(BIOSIGRP_CXPWRSUPP, BIOSIOFFS_CXPWRSUPP_GETTYPE)
+	bbapi_lock(NULL);
+	for (i = 0; i < ARRAY_SIZE(cache->entries); ++i) {
+		struct bbapi_mapping *const m = &cache->entries[i];
 
-#define bbapi_supports_sups() \
-	(bbapi_supports(BIOSIGRP_SUPS, BIOSIOFFS_SUPS_GPIO_PIN_EX) \
-	 || bbapi_supports(BIOSIGRP_SUPS, BIOSIOFFS_SUPS_GPIO_PIN))
+		if (!m->virt) {
+			continue;
+		}
+		if (m->refcount) {
+			pr_warn("BIOS did not unmap 0x%llx (%u references)\n",
+				(unsigned long long)m->phys, m->refcount);
+		}
+		cache->iounmaps++;
+		iounmap(m->virt);
+		memset(m, 0, sizeof(*m));
+	}
+	bbapi_unlock();
+}
 
 #ifdef __i386__
 typedef void __iomem *(*map_func) (int64_t, uint32_t, ...);
@@ -451,7 +2847,7 @@ static __attribute__ ((ms_abi))
 void __iomem *ExtOsMapPhysAddr(int64_t physAddr, uint32_t memSize)
 #endif
 {
-	return ioremap((unsigned long)physAddr, memSize);
+	return bbapi_map((phys_addr_t)physAddr, memSize);
 }
 
 #ifdef __i386__
@@ -464,7 +2860,7 @@ static __attribute__ ((ms_abi))
 void ExtOsUnMapPhysAddr(void *pLinMem, uint32_t memSize)
 #endif
 {
-	iounmap((void __iomem *)pLinMem);
+	bbapi_unmap((void __iomem *)pLinMem);
 }
 
 struct EXTOS_FUNCTION_ENTRY {
@@ -505,6 +2901,573 @@ static void __exit bbapi_exit_bios(void)
 	}
 }
 
+#define BBAPI_TRACE_PANIC_DUMP 16	// number of BIOS calls dumped on panic
+
+/**
+ * bbapi_trace_dump() - print the most recent BIOS calls in issue order
+ * @m: seq_file to print into, NULL to print into the kernel log
+ * @num: maximum number of BIOS calls to print
+ */
+static void bbapi_trace_dump(struct seq_file *m, u64 num)
+{
+	const u64 last = atomic64_read(&g_bbapi_trace_seq);
+	u64 seq = (last > num) ? last - num + 1 : 1;
+	struct bbapi_trace_entry e;
+	char line[192];
+
+	for (; seq <= last; ++seq) {
+		if (!bbapi_trace_find(seq, &e)) {
+			continue;
+		}
+		bbapi_trace_format(&e, line, sizeof(line));
+		if (m) {
+			seq_puts(m, line);
+		} else {
+			pr_emerg("%s", line);
+		}
+	}
+}
+
+#ifndef __FreeBSD__
+/**
+ * The panic notifiers run before kmsg_dump(), dumping the flight recorder
+ * here makes it part of the log pstore/ramoops preserves across the reset.
+ * A reset by the hardware watchdog never gets here, the record only covers
+ * panics.
+ */
+static int bbapi_trace_panic(struct notifier_block *nb, unsigned long event,
+			     void *unused)
+{
+	pr_emerg("last BIOS calls before panic:\n");
+	bbapi_trace_dump(NULL, BBAPI_TRACE_PANIC_DUMP);
+	return NOTIFY_DONE;
+}
+
+static struct notifier_block bbapi_panic_nb = {
+	.notifier_call = bbapi_trace_panic,
+};
+#endif
+
+#if IS_ENABLED(CONFIG_DEBUG_FS)
+#define BBAPI_LATENCY_WARM_CALLS 16
+
+static s64 bbapi_latency_probe(void)
+{
+	uint32_t platform = 0;
+	const ktime_t start = ktime_get();
+
+	bbapi_read(BIOSIGRP_GENERAL, BIOSIOFFS_GENERAL_GETPLATFORMINFO,
+		   &platform, sizeof(platform));
+	return ktime_to_ns(ktime_sub(ktime_get(), start));
+}
+
+/**
+ * bbapi_latency_measure() - compare cold and warm BIOS call latency
+ * @m: seq_file to print to
+ *
+ * Times a cheap BIOS call once after whatever idle period preceded it and
+ * then the fastest of BBAPI_LATENCY_WARM_CALLS back-to-back repetitions.
+ * Reading the debugfs file after the system was idle for a while shows
+ * how much the first call suffers from cold caches and TLBs.
+ */
+static void bbapi_latency_measure(struct seq_file *m)
+{
+	const u64 last = READ_ONCE(g_bbapi_last_call);
+	const u64 idle = last ? ktime_get_ns() - last : 0;
+	s64 cold, warm = S64_MAX;
+	size_t i;
+
+	cold = bbapi_latency_probe();
+	for (i = 0; i < BBAPI_LATENCY_WARM_CALLS; ++i) {
+		warm = min(warm, bbapi_latency_probe());
+	}
+	seq_printf(m, "idle %llu ms: cold %lld ns, warm %lld ns\n",
+		   div_u64(idle, NSEC_PER_MSEC), cold, warm);
+}
+
+static int bbapi_trace_show(struct seq_file *m, void *unused)
+{
+	bbapi_trace_dump(m, (u64)BBAPI_TRACE_SIZE * num_possible_cpus());
+	return 0;
+}
+
+static int bbapi_trace_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, bbapi_trace_show, inode->i_private);
+}
+
+static const struct file_operations bbapi_trace_fops = {
+	.owner = THIS_MODULE,
+	.open = bbapi_trace_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static int bbapi_mappings_show(struct seq_file *m, void *unused)
+{
+	const struct bbapi_map_cache *const cache = &g_bbapi_maps;
+	size_t i;
+
+	bbapi_lock(NULL);
+	seq_printf(m, "map: %llu unmap: %llu hits: %llu\n",
+		   cache->map_calls, cache->unmap_calls, cache->hits);
+	seq_printf(m, "ioremap: %llu iounmap: %llu evictions: %llu\n",
+		   cache->ioremaps, cache->iounmaps, cache->evictions);
+	for (i = 0; i < ARRAY_SIZE(cache->entries); ++i) {
+		const struct bbapi_mapping *const e = &cache->entries[i];
+
+		if (e->virt) {
+			seq_printf(m, "0x%llx+0x%zx refs: %u\n",
+				   (unsigned long long)e->phys, e->size,
+				   e->refcount);
+		}
+	}
+	bbapi_unlock();
+	return 0;
+}
+
+static int bbapi_mappings_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, bbapi_mappings_show, inode->i_private);
+}
+
+static const struct file_operations bbapi_mappings_fops = {
+	.owner = THIS_MODULE,
+	.open = bbapi_mappings_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static int bbapi_reads_show(struct seq_file *m, void *unused)
+{
+	const struct bbapi_shared_read *r;
+
+	mutex_lock(&g_bbapi_reads.lock);
+	seq_printf(m, "reads: %lld coalesced: %lld\n",
+		   (long long)atomic64_read(&g_bbapi_reads.reads),
+		   (long long)atomic64_read(&g_bbapi_reads.coalesced));
+	list_for_each_entry(r, &g_bbapi_reads.pending, node) {
+		seq_printf(m, "0x%x:0x%x size: %u users: %u\n", r->group,
+			   r->offset, r->size, r->users);
+	}
+	mutex_unlock(&g_bbapi_reads.lock);
+	return 0;
+}
+
+static int bbapi_reads_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, bbapi_reads_show, inode->i_private);
+}
+
+static const struct file_operations bbapi_reads_fops = {
+	.owner = THIS_MODULE,
+	.open = bbapi_reads_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static int bbapi_polls_show(struct seq_file *m, void *unused)
+{
+	const struct bbapi_poll *p;
+	u64 now;
+
+	mutex_lock(&g_bbapi_polls.lock);
+	now = ktime_get_ns();
+	seq_printf(m, "wakeups: %llu polls executed: %llu\n",
+		   g_bbapi_polls.wakeups, g_bbapi_polls.batches);
+	list_for_each_entry(p, &g_bbapi_polls.polls, node) {
+		const s64 next = p->next - now;
+
+		seq_printf(m, "%pS: %zu calls every %u ms (slack %u ms) runs: %llu next: %lld ms\n",
+			   (void *)p->complete, p->num, p->period_ms,
+			   p->slack_ms, p->runs, div_s64(next, NSEC_PER_MSEC));
+	}
+	mutex_unlock(&g_bbapi_polls.lock);
+	return 0;
+}
+
+static int bbapi_polls_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, bbapi_polls_show, inode->i_private);
+}
+
+static const struct file_operations bbapi_polls_fops = {
+	.owner = THIS_MODULE,
+	.open = bbapi_polls_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static int bbapi_quiesce_show(struct seq_file *m, void *unused)
+{
+	seq_printf(m, "quiesced: %d rejected: %lld deferred polls: %lld\n",
+		   READ_ONCE(g_bbapi_quiesced),
+		   (long long)atomic64_read(&g_bbapi_quiesce_rejected),
+		   (long long)atomic64_read(&g_bbapi_quiesce_deferred));
+	return 0;
+}
+
+static int bbapi_quiesce_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, bbapi_quiesce_show, inode->i_private);
+}
+
+static const struct file_operations bbapi_quiesce_fops = {
+	.owner = THIS_MODULE,
+	.open = bbapi_quiesce_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static int bbapi_guard_show(struct seq_file *m, void *unused)
+{
+	const struct bbapi_jitter_guard *const g = &g_bbapi_guard;
+	const u64 until = READ_ONCE(g->until);
+	const u64 now = ktime_get_ns();
+
+	seq_printf(m, "budget: %lu us cooldown: %u ms remaining: %llu ms\n",
+		   READ_ONCE(g_bbapi_call_budget_us),
+		   READ_ONCE(g_bbapi_cooldown_ms),
+		   (until > now) ? div_u64(until - now, NSEC_PER_MSEC) : 0);
+	seq_printf(m, "worst: %llu us overruns: %lld\n",
+		   div_u64(READ_ONCE(g->worst), NSEC_PER_USEC),
+		   (long long)atomic64_read(&g->overruns));
+	seq_printf(m, "throttled: %lld rejected: %lld deferred polls: %lld\n",
+		   (long long)atomic64_read(&g->throttled),
+		   (long long)atomic64_read(&g->rejected),
+		   (long long)atomic64_read(&g->deferred));
+	return 0;
+}
+
+static int bbapi_guard_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, bbapi_guard_show, inode->i_private);
+}
+
+static const struct file_operations bbapi_guard_fops = {
+	.owner = THIS_MODULE,
+	.open = bbapi_guard_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static void bbapi_qos_stats_show(struct seq_file *m, const char *name,
+				 const struct bbapi_qos_stats *stats)
+{
+	seq_printf(m, "%s: calls %llu avg %llu ns worst %llu ns\n", name,
+		   stats->calls,
+		   stats->calls ? div64_u64(stats->total, stats->calls) : 0,
+		   stats->worst);
+}
+
+static int bbapi_qos_show(struct seq_file *m, void *unused)
+{
+	struct bbapi_qos_state *const q = &g_bbapi_qos;
+
+	mutex_lock(&g_bbapi.mutex);
+#ifndef __FreeBSD__
+	seq_printf(m, "latency: %d us hold: %u ms held: %d\n",
+		   READ_ONCE(g_bbapi_qos_latency_us),
+		   READ_ONCE(g_bbapi_qos_hold_ms), q->held);
+#endif
+	bbapi_qos_stats_show(m, "first call after idle", &q->stats[0]);
+	bbapi_qos_stats_show(m, "first call within hold", &q->stats[1]);
+	bbapi_unlock();
+	return 0;
+}
+
+static int bbapi_qos_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, bbapi_qos_show, inode->i_private);
+}
+
+static const struct file_operations bbapi_qos_fops = {
+	.owner = THIS_MODULE,
+	.open = bbapi_qos_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static int bbapi_write_behind_show(struct seq_file *m, void *unused)
+{
+	struct bbapi_write_behind *const wb = &g_bbapi_wb;
+	unsigned long flags;
+	size_t pending = 0;
+	size_t i;
+
+	spin_lock_irqsave(&wb->lock, flags);
+	for (i = 0; i < ARRAY_SIZE(wb->slots); ++i) {
+		pending += wb->slots[i].pending;
+	}
+	seq_printf(m, "pending: %zu submitted: %llu replaced: %llu\n", pending,
+		   wb->submitted, wb->replaced);
+	spin_unlock_irqrestore(&wb->lock, flags);
+	seq_printf(m, "flushed: %llu failed: %llu dropped: %llu\n",
+		   READ_ONCE(wb->flushed), READ_ONCE(wb->failed),
+		   READ_ONCE(wb->dropped));
+	return 0;
+}
+
+static int bbapi_write_behind_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, bbapi_write_behind_show, inode->i_private);
+}
+
+static const struct file_operations bbapi_write_behind_fops = {
+	.owner = THIS_MODULE,
+	.open = bbapi_write_behind_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static int bbapi_persist_show(struct seq_file *m, void *unused)
+{
+	const struct bbapi_persist_state *const p = &g_bbapi_persist;
+
+	seq_printf(m, "armed: %d frozen: %d writes: %llu\n",
+		   READ_ONCE(p->active) >= 0, READ_ONCE(p->frozen), p->writes);
+	if (p->writes) {
+		seq_printf(m, "last write: status 0x%x, %llu us after power fail\n",
+			   p->status, div_u64(p->duration, NSEC_PER_USEC));
+	}
+	return 0;
+}
+
+static int bbapi_persist_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, bbapi_persist_show, inode->i_private);
+}
+
+static const struct file_operations bbapi_persist_fops = {
+	.owner = THIS_MODULE,
+	.open = bbapi_persist_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+#ifndef __FreeBSD__
+#define BBAPI_LATENCY_AB_ROUNDS 8
+#define BBAPI_LATENCY_AB_GAP_MS 50
+
+/**
+ * bbapi_latency_idle_probe() - time a BIOS call after an idle gap
+ * @latency: CPU latency request held during the gap, negative for none
+ *
+ * The burst hint of bbapi_qos_begin() is dropped before the gap and the
+ * call bypasses bbapi_lock(), so only @latency decides which C-states the
+ * cpu may enter. The time is taken from the expiry of the gap's timer, so
+ * it includes the C-state exit latency of the wakeup.
+ *
+ * Return: nanoseconds from the timer expiry to the end of the BIOS call,
+ * -EBUSY if the BIOS API is quiesced
+ */
+static s64 bbapi_latency_idle_probe(int latency)
+{
+	const struct bbapi_struct cmd = {
+		.nIndexGroup = BIOSIGRP_GENERAL,
+		.nIndexOffset = BIOSIOFFS_GENERAL_GETPLATFORMINFO,
+		.nOutBufferSize = sizeof(uint32_t),
+	};
+	struct pm_qos_request req;
+	uint32_t platform = 0;
+	uint32_t written = 0;
+	ktime_t expires;
+	s64 duration = -EBUSY;
+
+	memset(&req, 0, sizeof(req));
+	mod_delayed_work(system_wq, &g_bbapi_qos.release, 0);
+	flush_delayed_work(&g_bbapi_qos.release);
+	if (latency >= 0) {
+		bbapi_qos_add(&req, latency);
+	}
+	expires = ktime_add_ms(ktime_get(), BBAPI_LATENCY_AB_GAP_MS);
+	set_current_state(TASK_UNINTERRUPTIBLE);
+	schedule_hrtimeout_range(&expires, 0, HRTIMER_MODE_ABS);
+
+	/* not bbapi_lock(), that would apply the burst hint */
+	__bbapi_lock(NULL);
+	if (!bbapi_quiesce_rejects(cmd.nIndexGroup)) {
+		bbapi_call_retry(NULL, &platform, g_bbapi.entry, &cmd,
+				 &written, _RET_IP_, NULL);
+		duration = ktime_to_ns(ktime_sub(ktime_get(), expires));
+	}
+	bbapi_unlock();
+	if (latency >= 0) {
+		bbapi_qos_remove(&req);
+	}
+	return duration;
+}
+
+/**
+ * bbapi_latency_ab() - compare calls after the same idle gap with and
+ *                      without the CPU latency hint
+ * @m: seq_file to print to
+ *
+ * The rounds alternate between both variants, so drift affects both the
+ * same way. Without qos_latency_us configured the hint requests 0 us.
+ * Each sample covers the wakeup from the gap and the BIOS call.
+ */
+static void bbapi_latency_ab(struct seq_file *m)
+{
+	const int latency = max(READ_ONCE(g_bbapi_qos_latency_us), 0);
+	s64 sum[2] = { 0, 0 };
+	s64 best[2] = { S64_MAX, S64_MAX };
+	size_t i, hint;
+
+	for (i = 0; i < BBAPI_LATENCY_AB_ROUNDS; ++i) {
+		for (hint = 0; hint < 2; ++hint) {
+			const s64 d =
+			    bbapi_latency_idle_probe(hint ? latency : -1);
+
+			if (d < 0) {
+				seq_puts(m, "aborted, BIOS API quiesced\n");
+				return;
+			}
+			sum[hint] += d;
+			best[hint] = min(best[hint], d);
+		}
+	}
+	for (hint = 0; hint < 2; ++hint) {
+		seq_printf(m, "gap %u ms %s hint (%d us): avg %lld ns best %lld ns\n",
+			   BBAPI_LATENCY_AB_GAP_MS, hint ? "with" : "without",
+			   latency, div_s64(sum[hint], BBAPI_LATENCY_AB_ROUNDS),
+			   best[hint]);
+	}
+}
+#else
+static void bbapi_latency_ab(struct seq_file *m)
+{
+}
+#endif
+
+static int bbapi_latency_show(struct seq_file *m, void *unused)
+{
+	bbapi_latency_measure(m);
+	bbapi_latency_ab(m);
+	return 0;
+}
+
+static int bbapi_latency_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, bbapi_latency_show, inode->i_private);
+}
+
+static const struct file_operations bbapi_latency_fops = {
+	.owner = THIS_MODULE,
+	.open = bbapi_latency_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+/**
+ * bbapi_shadow_show() - location of the BIOS copy
+ *
+ * Together with the raw image in "shadow", this lets tools attribute
+ * samples which perf can't resolve to a symbol to offsets in the BIOS.
+ */
+static int bbapi_shadow_show(struct seq_file *m, void *unused)
+{
+	seq_printf(m, "base: 0x%px\n", g_bbapi.memory);
+	seq_printf(m, "size: 0x%zx\n", g_bbapi.size);
+	seq_printf(m, "entry: 0x%px\n", g_bbapi.entry);
+	return 0;
+}
+
+static int bbapi_shadow_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, bbapi_shadow_show, inode->i_private);
+}
+
+static const struct file_operations bbapi_shadow_fops = {
+	.owner = THIS_MODULE,
+	.open = bbapi_shadow_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static struct debugfs_blob_wrapper g_bbapi_shadow_blob;
+
+static void bbapi_debugfs_init(struct bbapi_object *bbapi)
+{
+	bbapi->debugfs = debugfs_create_dir(KBUILD_MODNAME, NULL);
+	g_bbapi_shadow_blob.data = bbapi->memory;
+	g_bbapi_shadow_blob.size = bbapi->size;
+	debugfs_create_blob("shadow", 0400, bbapi->debugfs,
+			    &g_bbapi_shadow_blob);
+	debugfs_create_file("shadow_info", 0400, bbapi->debugfs, NULL,
+			    &bbapi_shadow_fops);
+	debugfs_create_file("trace", 0400, bbapi->debugfs, NULL,
+			    &bbapi_trace_fops);
+	debugfs_create_file("mappings", 0400, bbapi->debugfs, NULL,
+			    &bbapi_mappings_fops);
+	debugfs_create_file("latency", 0400, bbapi->debugfs, NULL,
+			    &bbapi_latency_fops);
+	debugfs_create_file("reads", 0400, bbapi->debugfs, NULL,
+			    &bbapi_reads_fops);
+	debugfs_create_file("polls", 0400, bbapi->debugfs, NULL,
+			    &bbapi_polls_fops);
+	debugfs_create_file("quiesce", 0400, bbapi->debugfs, NULL,
+			    &bbapi_quiesce_fops);
+	debugfs_create_file("persist", 0400, bbapi->debugfs, NULL,
+			    &bbapi_persist_fops);
+	debugfs_create_file("guard", 0400, bbapi->debugfs, NULL,
+			    &bbapi_guard_fops);
+	debugfs_create_file("qos", 0400, bbapi->debugfs, NULL,
+			    &bbapi_qos_fops);
+	debugfs_create_file("write_behind", 0400, bbapi->debugfs, NULL,
+			    &bbapi_write_behind_fops);
+}
+#else
+static void bbapi_debugfs_init(struct bbapi_object *bbapi)
+{
+}
+#endif
+
+static bool g_bbapi_power_registered;
+static bool g_bbapi_sups_registered;
+
+/**
+ * bbapi_probe_work() - second, asynchronous stage of the initialization
+ *
+ * Probing the BIOS capabilities and registering the platform_devices for the
+ * sibling drivers take several BIOS calls. None of them is required to serve
+ * /dev/bbapi, so we run them after bbapi_init_module() returned to keep this
+ * module off the boot critical path.
+ */
+static void bbapi_probe_work(struct work_struct *work)
+{
+	const ktime_t start = ktime_get();
+
+	if (bbapi_supports_power()) {
+		if (platform_device_register(&bbapi_power)) {
+			pr_err("register %s failed\n", bbapi_power.name);
+		} else {
+			g_bbapi_power_registered = true;
+		}
+	}
+
+	if (bbapi_supports_sups()) {
+		if (platform_device_register(&bbapi_sups)) {
+			pr_err("register %s failed\n", bbapi_sups.name);
+		} else {
+			g_bbapi_sups_registered = true;
+		}
+	}
+	pr_info("async init: probe %lld us\n",
+		ktime_us_delta(ktime_get(), start));
+}
+
 static const struct dmi_system_id bbapi_unsupported_list[] = {
 	{
 		.ident = "Hyper-V",
@@ -519,10 +3482,24 @@ static const struct dmi_system_id bbapi_unsupported_list[] = {
 
 static int __init bbapi_init_module(void)
 {
+	ktime_t start, copied, cdev, bios;
 	int result;
 
 	pr_info("%s, %s\n", DRV_DESCRIPTION, DRV_VERSION);
 	mutex_init(&g_bbapi.mutex);
+	init_waitqueue_head(&g_bbapi.wq);
+	mutex_init(&g_bbapi_reads.lock);
+	INIT_LIST_HEAD(&g_bbapi_reads.pending);
+	mutex_init(&g_bbapi_polls.lock);
+	INIT_LIST_HEAD(&g_bbapi_polls.polls);
+	INIT_DELAYED_WORK(&g_bbapi_polls.work, bbapi_poll_work);
+	init_waitqueue_head(&g_bbapi_polls.idle);
+	mutex_init(&g_bbapi_persist.lock);
+	INIT_WORK(&g_bbapi_persist.work, bbapi_persist_work);
+	INIT_DELAYED_WORK(&g_bbapi_qos.release, bbapi_qos_release);
+	spin_lock_init(&g_bbapi_wb.lock);
+	INIT_WORK(&g_bbapi_wb.work, bbapi_wb_work);
+	INIT_WORK(&g_bbapi.probe_work, bbapi_probe_work);
 
 	if (dmi_check_system(bbapi_unsupported_list)) {
 		pr_err("BIOS API not supported on this System!\n");
@@ -537,55 +3514,47 @@ static int __init bbapi_init_module(void)
 	fcn_vmalloc_node_range = (fcn_vmalloc_node_range_t)fcn_kallsyms_lookup_name("__vmalloc_node_range");
 #endif
 
+	start = ktime_get();
 	result = bbapi_find_bios(&g_bbapi);
 	if (result) {
 		pr_err("BIOS API not available on this System\n");
 		return result;
 	}
-
-	if (bbapi_supports_power()) {
-		result = platform_device_register(&bbapi_power);
-		if (result) {
-			pr_err("register %s failed\n", bbapi_power.name);
-			goto rollback_memory;
-		}
-	}
-
-	if (bbapi_supports_sups()) {
-		result = platform_device_register(&bbapi_sups);
-		if (result) {
-			pr_err("register %s failed\n", bbapi_sups.name);
-			goto rollback_power;
-		}
-	}
+	copied = ktime_get();
 
 	result =
 	    simple_cdev_init(&g_bbapi.dev, "chardev", KBUILD_MODNAME,
 			     &file_ops);
 	if (result) {
 		pr_err("register bbapi chardev failed\n");
-		goto rollback_sups;
+		goto rollback_memory;
 	}
+	cdev = ktime_get();
 
 	bbapi_init_bios();
+	bios = ktime_get();
 
+	/*
+	 * The splash has to be written before bbapi_init_module() returns.
+	 * Otherwise it could overwrite the lines bbapi_disp already sent.
+	 */
 	if (bbapi_supports_display()) {
 		update_display();
 	}
-	return 0;
+	pr_info("init: search+copy %lld us, chardev %lld us, init BIOS %lld us, display %lld us\n",
+		ktime_us_delta(copied, start), ktime_us_delta(cdev, copied),
+		ktime_us_delta(bios, cdev), ktime_us_delta(ktime_get(), bios));
 
-rollback_sups:
-	if (bbapi_supports_sups()) {
-		platform_device_unregister(&bbapi_sups);
-	}
+	queue_work(system_unbound_wq, &g_bbapi.probe_work);
 
-rollback_power:
-	if (bbapi_supports_power()) {
-		platform_device_unregister(&bbapi_power);
-	}
+	bbapi_debugfs_init(&g_bbapi);
+#ifndef __FreeBSD__
+	atomic_notifier_chain_register(&panic_notifier_list, &bbapi_panic_nb);
+#endif
+	return 0;
 
 rollback_memory:
-	vfree(g_bbapi.memory);
+	bbapi_free_bios(&g_bbapi);
 	return result;
 }
 
@@ -594,17 +3563,28 @@ static void __exit bbapi_exit(void)
 	if (!g_bbapi.memory)
 		return;
 
+	flush_work(&g_bbapi.probe_work);
+	cancel_delayed_work_sync(&g_bbapi_polls.work);
+#ifndef __FreeBSD__
+	atomic_notifier_chain_unregister(&panic_notifier_list, &bbapi_panic_nb);
+#endif
+	debugfs_remove_recursive(g_bbapi.debugfs);
+	flush_work(&g_bbapi_wb.work);
 	bbapi_exit_bios();
 	simple_cdev_remove(&g_bbapi.dev);
+	bbapi_map_cache_flush();
 
-	if (bbapi_supports_sups()) {
+	if (g_bbapi_sups_registered) {
 		platform_device_unregister(&bbapi_sups);
 	}
 
-	if (bbapi_supports_power()) {
+	if (g_bbapi_power_registered) {
 		platform_device_unregister(&bbapi_power);
 	}
-	vfree(g_bbapi.memory);
+	cancel_work_sync(&g_bbapi_persist.work);
+	cancel_work_sync(&g_bbapi_wb.work);
+	bbapi_qos_exit();
+	bbapi_free_bios(&g_bbapi);
 }
 
 module_init(bbapi_init_module);
@@ -12,6 +12,8 @@
 #define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
 
 #include <linux/mutex.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
 #include "simple_cdev.h"
 
 #define BBIOSAPI_SIGNATURE_PHYS_START_ADDR 0xFFE00000	// Defining the Physical start address for the search
@@ -21,21 +23,30 @@
 /**
  * struct bbapi_object - manage access to Beckhoff BIOS functions
  * @memory: pointer to a BIOS copy in RAM
+ * @size: size of the BIOS copy in bytes
  * @entry: function pointer to the BIOS API function in RAM
  * @in: buffer to exchange data between user space and BIOS
  * @out: buffer to exchange data between BIOS and user space
  * @dev: meta data for the character device interface
+ * @mutex: serializes all calls into the BIOS
+ * @wq: woken whenever @mutex is released, callers with a deadline wait here
+ * @debugfs: debugfs directory with diagnostics like the BIOS call trace
+ * @probe_work: asynchronous part of the module initialization
  *
  * The size of the output buffer should be large enough to satisfy the
  * largest BIOS command. Right now this is: BIOSIOFFS_UEEPROM_READ.
  */
 struct bbapi_object {
 	uint8_t *memory;
+	size_t size;
 	void *entry;
 	char in[BBAPI_BUFFER_SIZE];
 	char out[BBAPI_BUFFER_SIZE];
 	struct simple_cdev dev;
 	struct mutex mutex;
+	wait_queue_head_t wq;
+	struct dentry *debugfs;
+	struct work_struct probe_work;
 };
 
 extern unsigned int bbapi_read(uint32_t group, uint32_t offset,
@@ -48,5 +59,72 @@ extern unsigned int bbapi_rw(uint32_t group, uint32_t offset,
 				void __kernel * in, uint32_t size_in,
 				void __kernel * out, uint32_t size_out, uint32_t *bytes_written);
 
+/**
+ * struct bbapi_xfer - one BIOS call of a bbapi_rw_multi() batch
+ * @group: IndexGroup
+ * @offset: IndexOffset
+ * @in: input buffer or NULL
+ * @size_in: size of @in in bytes
+ * @out: output buffer or NULL
+ * @size_out: size of @out in bytes
+ * @status: result of the call, encoded like the return value of bbapi_rw()
+ */
+struct bbapi_xfer {
+	uint32_t group;
+	uint32_t offset;
+	void __kernel *in;
+	uint32_t size_in;
+	void __kernel *out;
+	uint32_t size_out;
+	unsigned int status;
+};
+
+#define BBAPI_XFER_READ(grp, off, buf, size) \
+	{ .group = (grp), .offset = (off), .out = (buf), .size_out = (size) }
+
+#define BBAPI_XFER_WRITE(grp, off, buf, size) \
+	{ .group = (grp), .offset = (off), .in = (buf), .size_in = (size) }
+
+extern unsigned int bbapi_rw_multi(struct bbapi_xfer *xfers, size_t num);
+
+extern int bbapi_write_behind(uint32_t group, uint32_t offset,
+			      const void __kernel *in, uint32_t size);
+
+/**
+ * struct bbapi_poll - BIOS calls executed periodically by the poll scheduler
+ * @xfers: BIOS calls to execute, as one batch like bbapi_rw_multi()
+ * @num: number of elements in @xfers
+ * @period_ms: interval between two executions in milliseconds
+ * @slack_ms: the poll may run up to this many milliseconds early, to share
+ *            a wakeup and lock acquisition with another poll
+ * @complete: called after @xfers were executed, may be NULL. It runs in
+ *            the context of the scheduler and must not sleep for long.
+ *            The status of each element of @xfers tells if it succeeded.
+ * @node: private to api.c
+ * @run: private to api.c
+ * @next: private to api.c
+ * @runs: private to api.c
+ * @running: private to api.c
+ */
+struct bbapi_poll {
+	struct bbapi_xfer *xfers;
+	size_t num;
+	unsigned int period_ms;
+	unsigned int slack_ms;
+	void (*complete)(struct bbapi_poll *poll);
+	struct list_head node;
+	struct list_head run;
+	u64 next;
+	u64 runs;
+	bool running;
+};
+
+extern int bbapi_poll_register(struct bbapi_poll *poll);
+extern void bbapi_poll_unregister(struct bbapi_poll *poll);
+
+extern void bbapi_quiesce(bool enable);
+
+extern int bbapi_persist(const void __kernel *data, size_t size);
+
 extern int bbapi_board_is(const char *boardname);
 #endif /* #ifndef __API_H_ */
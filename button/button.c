@@ -5,11 +5,8 @@
     Copyright (C) 2016 - 2018 Beckhoff Automation GmbH & Co. KG
 */
 
-#include <linux/hrtimer.h>
 #include <linux/input.h>
 #include <linux/module.h>
-#include <linux/sched.h>
-#include <linux/workqueue.h>
 
 #include "../api.h"
 #include "../TcBaDevDef.h"
@@ -17,17 +14,22 @@
 #define DRV_VERSION      "0.2"
 #define DRV_DESCRIPTION  "Beckhoff BIOS API button driver"
 
-#define POLL_TIME ktime_set(0, 125000 * NSEC_PER_USEC)
+#define POLL_PERIOD_MS 125
+#define POLL_SLACK_MS 25
 
 static struct input_dev *input_dev;
-static struct hrtimer poll_timer;
+static u8 btn_state;
 
-static void button_poll(struct work_struct *work)
-{
-	u8 btn_state = 0;
+static struct bbapi_xfer poll_xfer =
+	BBAPI_XFER_READ(BIOSIGRP_CXPWRSUPP, BIOSIOFFS_CXPWRSUPP_GETBUTTONSTATE,
+			&btn_state, sizeof(btn_state));
 
-	bbapi_read(BIOSIGRP_CXPWRSUPP, BIOSIOFFS_CXPWRSUPP_GETBUTTONSTATE,
-		   &btn_state, sizeof(btn_state));
+static void button_poll(struct bbapi_poll *poll)
+{
+	/* btn_state is stale if the read failed */
+	if (poll_xfer.status) {
+		return;
+	}
 	input_report_abs(input_dev, ABS_X,
 			 ((btn_state >> 0) & 1) - ((btn_state >> 1) & 1));
 	input_report_abs(input_dev, ABS_Y,
@@ -35,26 +37,23 @@ static void button_poll(struct work_struct *work)
 	input_report_key(input_dev, BTN_0, ((btn_state >> 4) & 1));
 	input_sync(input_dev);
 }
-DECLARE_WORK(work, button_poll);
 
-static enum hrtimer_restart poll_timer_callback(struct hrtimer *timer)
-{
-	schedule_work(&work);
-	hrtimer_forward_now(timer, POLL_TIME);
-	return HRTIMER_RESTART;
-}
+static struct bbapi_poll poll = {
+	.xfers = &poll_xfer,
+	.num = 1,
+	.period_ms = POLL_PERIOD_MS,
+	.slack_ms = POLL_SLACK_MS,
+	.complete = button_poll,
+};
 
 static int button_open(struct input_dev *dev)
 {
-	hrtimer_init(&poll_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
-	poll_timer.function = poll_timer_callback;
-	hrtimer_start(&poll_timer, POLL_TIME, HRTIMER_MODE_REL);
-	return 0;
+	return bbapi_poll_register(&poll);
 }
 
 static void button_close(struct input_dev *dev)
 {
-	hrtimer_cancel(&poll_timer);
+	bbapi_poll_unregister(&poll);
 }
 
 static int __init button_init(void)
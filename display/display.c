@@ -6,12 +6,18 @@
 */
 
 #include <linux/ctype.h>
+#include <linux/debugfs.h>
 #include <linux/fs.h>
+#include <linux/input.h>
 #include <linux/miscdevice.h>
+#include <linux/mm.h>
 #include <linux/module.h>
+#include <linux/seq_file.h>
+#include <linux/seqlock.h>
 #include <linux/slab.h>
 #include <linux/version.h>
 #include <linux/kernel.h>
+#include <linux/workqueue.h>
 #if (LINUX_VERSION_CODE < KERNEL_VERSION(4,12,0))
 #include <asm/uaccess.h>
 #else
@@ -24,28 +30,293 @@
 #define DRV_VERSION      "0.3"
 #define DRV_DESCRIPTION  "Beckhoff BIOS API text display driver"
 
+static unsigned int flush_interval_ms = 20;
+module_param(flush_interval_ms, uint, 0644);
+MODULE_PARM_DESC(flush_interval_ms,
+		 "Minimum interval in ms between two updates of the display, 0 to update after every write()");
+
+#define DISPLAY_MAX_PAGES 16
+
+static unsigned int pages = 1;
+module_param(pages, uint, 0444);
+MODULE_PARM_DESC(pages,
+		 "Number of virtual display pages (1 - 16), the left and right buttons switch the visible page");
+
+#define NUM_ROWS ((size_t)2)
+#define NUM_COLS  ((size_t)16)
+#define DISPLAY_CELLS (NUM_ROWS * NUM_COLS)
+
+/**
+ * struct display_row - one row of the framebuffer
+ * @lock: writers of different rows never contend, display_flush() takes
+ *        a consistent snapshot without blocking writers
+ * @text: content of the row, NUL terminated as the BIOS expects it.
+ *        Points into display_page::mem, mmap() writes to it without
+ *        taking @lock.
+ */
+struct display_row {
+	seqlock_t lock;
+	char *text;
+};
+
+/**
+ * struct display_page - a virtual display
+ * @rows: the framebuffer
+ * @mem: page holding the text of @rows one after the other, shared with
+ *       mmap()
+ */
+struct display_page {
+	struct display_row rows[NUM_ROWS];
+	char *mem;
+};
+
+static struct display_page g_pages[DISPLAY_MAX_PAGES];
+
+/* index of the page shown on the display, only this page is flushed */
+static unsigned int g_visible;
+
 struct display_buffer {
 	size_t row;
 	size_t col;
+	struct display_page *page;
 };
 
-#define NUM_ROWS ((size_t)2)
-#define NUM_COLS  ((size_t)16)
-static char g_fb[NUM_ROWS][NUM_COLS + 1];
 static DEFINE_MUTEX(g_mutex);
 
-static void fb_init(void)
+/* lines as last sent to the BIOS, protected by g_mutex */
+static char g_hw[NUM_ROWS][NUM_COLS + 1];
+static bool g_hw_valid[NUM_ROWS];
+
+static void display_flush_work(struct work_struct *work);
+static DECLARE_DELAYED_WORK(g_flush_work, display_flush_work);
+
+/**
+ * struct display_stats - effect of the deferred flush
+ * @writes: number of write() calls
+ * @flushes: number of flushes which sent at least one line to the BIOS
+ * @saved: number of write() calls merged into an already pending flush
+ */
+static struct display_stats {
+	atomic64_t writes;
+	atomic64_t flushes;
+	atomic64_t saved;
+} g_stats;
+
+static void fb_init(struct display_page *const page)
+{
+	size_t i;
+
+	for (i = 0; i < NUM_ROWS; ++i) {
+		struct display_row *const row = &page->rows[i];
+
+		write_seqlock(&row->lock);
+		memset(row->text, ' ', NUM_COLS);
+		row->text[NUM_COLS] = '\0';
+		write_sequnlock(&row->lock);
+	}
+}
+
+static void fb_snapshot(struct display_page *const page, size_t i,
+			char *const line)
 {
+	const struct display_row *const row = &page->rows[i];
+	unsigned int seq;
+
+	do {
+		seq = read_seqbegin(&row->lock);
+		memcpy(line, row->text, NUM_COLS);
+	} while (read_seqretry(&row->lock, seq));
+	line[NUM_COLS] = '\0';
+}
+
+static struct display_page *display_visible(void)
+{
+	return &g_pages[READ_ONCE(g_visible)];
+}
+
+/**
+ * display_flush() - send the lines of the visible page which changed
+ *
+ * Lines are snapshotted into g_hw before they are sent, so g_hw always
+ * holds what the BIOS got and the BIOS never sees a row in the middle of
+ * an update. A line which failed is sent again by the next flush.
+ */
+static void display_flush(void)
+{
+	static const uint32_t offsets[NUM_ROWS] = {
+		BIOSIOFFS_CXPWRSUPP_DISPLAYLINE1,
+		BIOSIOFFS_CXPWRSUPP_DISPLAYLINE2,
+	};
+	struct bbapi_xfer lines[NUM_ROWS];
+	struct display_page *page;
+	char line[NUM_COLS + 1];
+	size_t rows[NUM_ROWS];
+	size_t num = 0;
+	size_t i;
+
 	mutex_lock(&g_mutex);
-	memset(g_fb, ' ', sizeof(g_fb));
-	g_fb[0][NUM_COLS] = '\0';
-	g_fb[1][NUM_COLS] = '\0';
+	page = display_visible();
+	for (i = 0; i < NUM_ROWS; ++i) {
+		fb_snapshot(page, i, line);
+		if (g_hw_valid[i] && !memcmp(g_hw[i], line, sizeof(g_hw[i]))) {
+			continue;
+		}
+		memcpy(g_hw[i], line, sizeof(g_hw[i]));
+		lines[num] = (struct bbapi_xfer)
+		    BBAPI_XFER_WRITE(BIOSIGRP_CXPWRSUPP, offsets[i], g_hw[i],
+				     sizeof(g_hw[i]));
+		rows[num++] = i;
+	}
+	if (num) {
+		bbapi_rw_multi(lines, num);
+		atomic64_inc(&g_stats.flushes);
+	}
+	for (i = 0; i < num; ++i) {
+		g_hw_valid[rows[i]] = !lines[i].status;
+	}
 	mutex_unlock(&g_mutex);
 }
 
+static void display_flush_work(struct work_struct *work)
+{
+	display_flush();
+}
+
+/**
+ * display_schedule_flush() - flush at most every flush_interval_ms
+ *
+ * The first write() after a flush arms the delayed work, all later writes
+ * until it runs are covered by it. Writes to a page in the background
+ * only update memory.
+ */
+static void display_schedule_flush(const struct display_page *const page)
+{
+	const unsigned int interval = READ_ONCE(flush_interval_ms);
+
+	atomic64_inc(&g_stats.writes);
+	if (page != display_visible()) {
+		return;
+	}
+	if (!interval) {
+		display_flush();
+	} else if (!queue_delayed_work(system_wq, &g_flush_work,
+				       msecs_to_jiffies(interval))) {
+		atomic64_inc(&g_stats.saved);
+	}
+}
+
+static int display_fsync(struct file *const f, loff_t start, loff_t end,
+			 int datasync)
+{
+	cancel_delayed_work(&g_flush_work);
+	display_flush();
+	return 0;
+}
+
+/**
+ * display_show() - make another page visible
+ * @index: index of the page
+ *
+ * Can be called from atomic context.
+ */
+static void display_show(unsigned int index)
+{
+	WRITE_ONCE(g_visible, index);
+	mod_delayed_work(system_wq, &g_flush_work, 0);
+}
+
+/**
+ * display_read() - read the framebuffer without a BIOS call
+ *
+ * The file offset of a cell is row * 16 + column, the rows are returned
+ * without line breaks.
+ */
+static ssize_t display_read(struct file *const f, char __user * buf,
+			    size_t len, loff_t * off)
+{
+	struct display_buffer *const db = f->private_data;
+	char cells[NUM_ROWS * NUM_COLS + 1];
+	size_t i;
+
+	if (*off < 0) {
+		return -EINVAL;
+	}
+	if (*off >= DISPLAY_CELLS) {
+		return 0;
+	}
+	for (i = 0; i < NUM_ROWS; ++i) {
+		/* the NUL of a row is overwritten by the next row */
+		fb_snapshot(db->page, i, &cells[i * NUM_COLS]);
+	}
+	len = min(len, (size_t)(DISPLAY_CELLS - *off));
+	if (copy_to_user(buf, &cells[*off], len)) {
+		return -EFAULT;
+	}
+	*off += len;
+	return len;
+}
+
+/**
+ * display_mmap() - map the framebuffer of the page selected for the file
+ *
+ * The mapping holds the NUL terminated rows of NUM_COLS + 1 bytes one
+ * after the other. Changes are sent to the display by msync(), fsync()
+ * or BBAPI_DISPLAY_FLUSH. Only shared mappings are accepted, stores to a
+ * private mapping would end up in a copy and never reach the display.
+ */
+static int display_mmap(struct file *const f, struct vm_area_struct *vma)
+{
+	struct display_buffer *const db = f->private_data;
+
+	if (vma->vm_pgoff || vma->vm_end - vma->vm_start > PAGE_SIZE) {
+		return -EINVAL;
+	}
+	if (!(vma->vm_flags & VM_SHARED)) {
+		return -EINVAL;
+	}
+	if (vma->vm_flags & VM_EXEC) {
+		return -EPERM;
+	}
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(6,3,0))
+	vma->vm_flags &= ~VM_MAYEXEC;
+	vma->vm_flags |= VM_DONTEXPAND;
+#else
+	vm_flags_clear(vma, VM_MAYEXEC);
+	vm_flags_set(vma, VM_DONTEXPAND);
+#endif
+	return vm_insert_page(vma, vma->vm_start, virt_to_page(db->page->mem));
+}
+
+static long display_ioctl(struct file *const f, unsigned int cmd,
+			  unsigned long arg)
+{
+	struct display_buffer *const db = f->private_data;
+
+	switch (cmd) {
+	case BBAPI_DISPLAY_FLUSH:
+		return display_fsync(f, 0, LLONG_MAX, 0);
+	case BBAPI_DISPLAY_SELECT:
+		if (arg >= pages) {
+			return -EINVAL;
+		}
+		db->page = &g_pages[arg];
+		return 0;
+	default:
+		return -ENOTTY;
+	}
+}
+
 static int display_open(struct inode *const i, struct file *const f)
 {
+	/* lines may have been changed through /dev/bbapi meanwhile */
+	mutex_lock(&g_mutex);
+	memset(g_hw_valid, 0, sizeof(g_hw_valid));
+	mutex_unlock(&g_mutex);
+
 	f->private_data = kzalloc(sizeof(struct display_buffer), GFP_KERNEL);
+	if (f->private_data) {
+		((struct display_buffer *)f->private_data)->page = &g_pages[0];
+	}
 	return NULL == f->private_data;
 }
 
@@ -55,84 +326,187 @@ static int display_release(struct inode *const i, struct file *const f)
 	return 0;
 }
 
+/**
+ * display_put() - copy a run of printable characters to the cursor
+ *
+ * The run wraps into the next row, characters beyond the last row are
+ * dropped.
+ */
+static void display_put(struct display_buffer *const db, const char *text,
+			size_t len)
+{
+	while (len && db->row < NUM_ROWS) {
+		const size_t n = min(len, NUM_COLS - db->col);
+		struct display_row *const row = &db->page->rows[db->row];
+
+		write_seqlock(&row->lock);
+		memcpy(&row->text[db->col], text, n);
+		write_sequnlock(&row->lock);
+		text += n;
+		len -= n;
+		db->col += n;
+		if (db->col >= NUM_COLS) {
+			db->col = 0;
+			db->row = min(NUM_ROWS, db->row + 1);
+		}
+	}
+}
+
+static void display_control(struct display_buffer *const db, const char next)
+{
+	switch (next) {
+	case '\b':		/* move cursor to previous character */
+		if (db->col) {
+			db->col--;
+		} else if (db->row) {
+			db->col = NUM_COLS - 1;
+			db->row--;
+		}
+		break;
+	case '\t':		/* move cursor to next character */
+		db->col++;
+		break;
+	case '\n':		/* move cursor to start of next row */
+		db->col = 0;
+		db->row++;
+		break;
+	case '\f':		/* clear screen and move cursor to column 0 of row 0 */
+		db->col = 0;
+		db->row = 0;
+		fb_init(db->page);
+		break;
+	case '\r':		/* move cursor to first character in row */
+		db->col = 0;
+		break;
+	case '\021':	/* enable backlight */
+		{
+			u8 enable = 0xff;
+			bbapi_write_behind(BIOSIGRP_CXPWRSUPP,
+					   BIOSIOFFS_CXPWRSUPP_ENABLEBACKLIGHT,
+					   &enable, sizeof(enable));
+			break;
+		}
+	case '\023':	/* disable backlight */
+		{
+			u8 disable = 0;
+			bbapi_write_behind(BIOSIGRP_CXPWRSUPP,
+					   BIOSIOFFS_CXPWRSUPP_ENABLEBACKLIGHT,
+					   &disable, sizeof(disable));
+			break;
+		}
+	default:
+		break;
+	}
+
+	/* calculate new positions */
+	if (db->col >= NUM_COLS) {
+		db->col = 0;
+		db->row = min(NUM_ROWS, db->row + 1);
+	}
+}
+
+/**
+ * display_parse() - apply a chunk of a write() to the framebuffer
+ *
+ * Runs of printable characters are copied at once, only control
+ * characters are handled one by one.
+ */
+static void display_parse(struct display_buffer *const db, const char *text,
+			  size_t len)
+{
+	const char *const end = text + len;
+
+	while (text < end) {
+		const char *run = text;
+
+		while (run < end && isprint(*run)) {
+			++run;
+		}
+		if (run != text) {
+			display_put(db, text, run - text);
+			text = run;
+		} else {
+			display_control(db, *text++);
+		}
+	}
+}
+
+#define DISPLAY_CHUNK_SIZE 64	// bytes copied from user space at once
+
+/**
+ * display_write() - write text to the framebuffer
+ *
+ * The file offset is the cursor, row * 16 + column. pwrite() updates a
+ * region of the display with a single call and flush.
+ */
 static ssize_t display_write(struct file *const f, const char __user * buf,
 			     size_t len, loff_t * off)
 {
 	struct display_buffer *const db = f->private_data;
+	const loff_t cursor = min_t(loff_t, *off, DISPLAY_CELLS);
+	char chunk[DISPLAY_CHUNK_SIZE];
 	size_t pos = 0;
-	char next;
 
+	if (*off < 0) {
+		return -EINVAL;
+	}
+	db->row = cursor / NUM_COLS;
+	db->col = cursor % NUM_COLS;
 	while (pos < len) {
-		get_user(next, buf + pos);
-		if (isprint(next) && db->row < NUM_ROWS) {
-			g_fb[db->row][db->col] = next;
-			db->col++;
-		} else {
-			switch (next) {
-			case '\b':	/* move cursor to previous character */
-				if (db->col) {
-					db->col--;
-				} else if (db->row) {
-					db->col = NUM_COLS - 1;
-					db->row--;
-				}
-				break;
-			case '\t':	/* move cursor to next character */
-				db->col++;
-				break;
-			case '\n':	/* move cursor to start of next row */
-				db->col = 0;
-				db->row++;
-				break;
-			case '\f':	/* clear screen and move cursor to column 0 of row 0 */
-				db->col = 0;
-				db->row = 0;
-				fb_init();
-				break;
-			case '\r':	/* move cursor to first character in row */
-				db->col = 0;
-				break;
-			case '\021':	/* enable backlight */
-				{
-					u8 enable = 0xff;
-					bbapi_write(BIOSIGRP_CXPWRSUPP,
-						    BIOSIOFFS_CXPWRSUPP_ENABLEBACKLIGHT,
-						    &enable, sizeof(enable));
-					break;
-				}
-			case '\023':	/* disable backlight */
-				{
-					u8 disable = 0;
-					bbapi_write(BIOSIGRP_CXPWRSUPP,
-						    BIOSIOFFS_CXPWRSUPP_ENABLEBACKLIGHT,
-						    &disable, sizeof(disable));
-					break;
-				}
-			default:
-				break;
-			}
-		}
+		const size_t n = min(len - pos, sizeof(chunk));
 
-		/* calculate new positions */
-		if (db->col >= NUM_COLS) {
-			db->col = 0;
-			db->row = min(NUM_ROWS, db->row + 1);
+		if (copy_from_user(chunk, buf + pos, n)) {
+			break;
 		}
-		++pos;
+		display_parse(db, chunk, n);
+		pos += n;
 	}
 
-	bbapi_write(BIOSIGRP_CXPWRSUPP, BIOSIOFFS_CXPWRSUPP_DISPLAYLINE1,
-		    g_fb[0], sizeof(g_fb[0]));
-	bbapi_write(BIOSIGRP_CXPWRSUPP, BIOSIOFFS_CXPWRSUPP_DISPLAYLINE2,
-		    g_fb[1], sizeof(g_fb[0]));
-	return len;
+	if (pos != len && !pos) {
+		return -EFAULT;
+	}
+	*off = min(DISPLAY_CELLS, db->row * NUM_COLS + db->col);
+	display_schedule_flush(db->page);
+	return pos;
+}
+
+/**
+ * display_llseek() - move the cursor
+ *
+ * Offsets beyond the last cell are clamped to DISPLAY_CELLS, SEEK_END is
+ * relative to it.
+ */
+static loff_t display_llseek(struct file *const f, loff_t offset, int whence)
+{
+	switch (whence) {
+	case SEEK_SET:
+		break;
+	case SEEK_CUR:
+		offset += f->f_pos;
+		break;
+	case SEEK_END:
+		offset += DISPLAY_CELLS;
+		break;
+	default:
+		return -EINVAL;
+	}
+	if (offset < 0) {
+		return -EINVAL;
+	}
+	f->f_pos = min_t(loff_t, offset, DISPLAY_CELLS);
+	return f->f_pos;
 }
 
 static struct file_operations display_ops = {
 	.owner = THIS_MODULE,
 	.open = display_open,
 	.release = display_release,
+	.llseek = display_llseek,
+	.read = display_read,
 	.write = display_write,
+	.fsync = display_fsync,
+	.mmap = display_mmap,
+	.unlocked_ioctl = display_ioctl,
 };
 
 static struct miscdevice display_device = {
@@ -141,16 +515,195 @@ static struct miscdevice display_device = {
 	.fops = &display_ops,
 };
 
+/**
+ * display_button_event() - switch pages with the left and right buttons
+ *
+ * ABS_X of the button device is 1 while right and -1 while left is pressed.
+ */
+static void display_button_event(struct input_handle *handle,
+				 unsigned int type, unsigned int code, int value)
+{
+	const unsigned int visible = READ_ONCE(g_visible);
+
+	if (type != EV_ABS || code != ABS_X || !value) {
+		return;
+	}
+	display_show((value > 0) ? (visible + 1) % pages :
+		     (visible + pages - 1) % pages);
+}
+
+/* name of the input device registered by 'bbapi_button' */
+static bool display_button_match(struct input_handler *handler,
+				 struct input_dev *dev)
+{
+	return dev->name && !strcmp(dev->name, "Beckhoff CX2100 Buttons");
+}
+
+static int display_button_connect(struct input_handler *handler,
+				  struct input_dev *dev,
+				  const struct input_device_id *id)
+{
+	struct input_handle *const handle = kzalloc(sizeof(*handle), GFP_KERNEL);
+	int error;
+
+	if (!handle) {
+		return -ENOMEM;
+	}
+	handle->dev = dev;
+	handle->handler = handler;
+	handle->name = KBUILD_MODNAME;
+
+	error = input_register_handle(handle);
+	if (error) {
+		goto free;
+	}
+	/* starts polling of the buttons */
+	error = input_open_device(handle);
+	if (error) {
+		goto unregister;
+	}
+	return 0;
+
+unregister:
+	input_unregister_handle(handle);
+free:
+	kfree(handle);
+	return error;
+}
+
+static void display_button_disconnect(struct input_handle *handle)
+{
+	input_close_device(handle);
+	input_unregister_handle(handle);
+	kfree(handle);
+}
+
+static const struct input_device_id display_button_ids[] = {
+	{
+		.flags = INPUT_DEVICE_ID_MATCH_EVBIT | INPUT_DEVICE_ID_MATCH_ABSBIT,
+		.evbit = { BIT_MASK(EV_ABS) },
+		.absbit = { BIT_MASK(ABS_X) },
+	},
+	{ },
+};
+
+static struct input_handler display_button_handler = {
+	.event = display_button_event,
+	.match = display_button_match,
+	.connect = display_button_connect,
+	.disconnect = display_button_disconnect,
+	.name = KBUILD_MODNAME,
+	.id_table = display_button_ids,
+};
+
+static void fb_free(void)
+{
+	size_t i;
+
+	for (i = 0; i < pages; ++i) {
+		free_page((unsigned long)g_pages[i].mem);
+	}
+}
+
+#if IS_ENABLED(CONFIG_DEBUG_FS)
+static struct dentry *g_debugfs;
+
+static int display_stats_show(struct seq_file *m, void *unused)
+{
+	seq_printf(m, "writes: %lld flushes: %lld saved: %lld\n",
+		   (long long)atomic64_read(&g_stats.writes),
+		   (long long)atomic64_read(&g_stats.flushes),
+		   (long long)atomic64_read(&g_stats.saved));
+	return 0;
+}
+
+static int display_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, display_stats_show, inode->i_private);
+}
+
+static const struct file_operations display_stats_fops = {
+	.owner = THIS_MODULE,
+	.open = display_stats_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static void display_debugfs_init(void)
+{
+	g_debugfs = debugfs_create_dir(KBUILD_MODNAME, NULL);
+	debugfs_create_file("stats", 0400, g_debugfs, NULL,
+			    &display_stats_fops);
+}
+
+static void display_debugfs_exit(void)
+{
+	debugfs_remove_recursive(g_debugfs);
+}
+#else
+static void display_debugfs_init(void)
+{
+}
+
+static void display_debugfs_exit(void)
+{
+}
+#endif
+
 static int __init bbapi_display_init_module(void)
 {
+	size_t i, j;
+	int result;
+
 	pr_info("%s, %s\n", DRV_DESCRIPTION, DRV_VERSION);
-	fb_init();
-	return misc_register(&display_device);
+	if (!pages || pages > DISPLAY_MAX_PAGES) {
+		pr_err("pages has to be between 1 and %d\n", DISPLAY_MAX_PAGES);
+		return -EINVAL;
+	}
+	for (i = 0; i < pages; ++i) {
+		struct display_page *const page = &g_pages[i];
+
+		page->mem = (char *)get_zeroed_page(GFP_KERNEL);
+		if (!page->mem) {
+			result = -ENOMEM;
+			goto free;
+		}
+		for (j = 0; j < NUM_ROWS; ++j) {
+			seqlock_init(&page->rows[j].lock);
+			page->rows[j].text = page->mem + j * (NUM_COLS + 1);
+		}
+		fb_init(page);
+	}
+	result = misc_register(&display_device);
+	if (result) {
+		goto free;
+	}
+	if (pages > 1) {
+		result = input_register_handler(&display_button_handler);
+		if (result) {
+			misc_deregister(&display_device);
+			goto free;
+		}
+	}
+	display_debugfs_init();
+	return 0;
+
+free:
+	fb_free();
+	return result;
 }
 
 static void __exit bbapi_display_exit(void)
 {
+	display_debugfs_exit();
+	if (pages > 1) {
+		input_unregister_handler(&display_button_handler);
+	}
 	misc_deregister(&display_device);
+	/* show what was written last, before the module is gone */
+	flush_delayed_work(&g_flush_work);
+	fb_free();
 	pr_info("Text display unregistered\n");
 }
 
@@ -96,16 +96,9 @@ void RunAtPos(size_t pos)
 		return;
 	}
 
-	/** move cursor to our position */
-	for (size_t i = 0; i <= pos; ++i) {
-		static const char tab = '\t';
-		write(fd, &tab, 1);
-	}
-
-	/** print some characters */
+	/** print some characters, the file offset is row * 16 + column */
 	for (unsigned char c = '~'; c != ('/' + pos % 10); c--) {
-		const unsigned char replace_char[2] = { '\b', c };
-		write(fd, replace_char, sizeof(replace_char));
+		pwrite(fd, &c, sizeof(c), pos);
 		/** sleep a little to let the other threads work, too */
 		std::this_thread::sleep_for(std::chrono::milliseconds(50));
 	}
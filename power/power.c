@@ -10,7 +10,6 @@
 #include <linux/slab.h>
 #include <linux/platform_device.h>
 #include <linux/power_supply.h>
-#include <linux/workqueue.h>
 
 #include "../api.h"
 #include "../TcBaDevDef.h"
@@ -22,8 +21,8 @@ struct bbapi_cx2100_info {
 	const char *manufacturer;
 	char serial[16];
 
-	struct workqueue_struct *monitor_wqueue;
-	struct delayed_work monitor;
+	struct bbapi_xfer xfers[6];
+	struct bbapi_poll monitor;
 	struct power_supply *psy;
 
 	uint16_t charging_current_mA;
@@ -57,33 +56,39 @@ static int ups_get_status(const struct bbapi_cx2100_info *pbi)
 	return POWER_SUPPLY_STATUS_NOT_CHARGING;
 }
 
-static void bbapi_cx2100_read_status(struct bbapi_cx2100_info *pbi)
+#define MONITOR_PERIOD_MS 5000
+#define MONITOR_SLACK_MS 1000
+
+static void bbapi_cx2100_init_xfers(struct bbapi_cx2100_info *pbi)
 {
-	bbapi_read(BIOSIGRP_CXPWRSUPP, BIOSIOFFS_CXPWRSUPP_GETTEMP,
-		   &pbi->temp_C, sizeof(pbi->temp_C));
-	bbapi_read(BIOSIGRP_CXUPS, BIOSIOFFS_CXUPS_GETPOWERSTATUS,
-		   &pbi->power_status, sizeof(pbi->power_status));
-	bbapi_read(BIOSIGRP_CXUPS, BIOSIOFFS_CXUPS_GETBATTERYPRESENT,
-		   &pbi->battery_present, sizeof(pbi->battery_present));
-	bbapi_read(BIOSIGRP_CXUPS, BIOSIOFFS_CXUPS_GETBATTERYCAPACITY,
-		   &pbi->capacity_percent, sizeof(pbi->capacity_percent));
-	bbapi_read(BIOSIGRP_CXUPS, BIOSIOFFS_CXUPS_GETBATTERYRUNTIME,
-		   &pbi->battery_runtime_s, sizeof(pbi->battery_runtime_s));
-	bbapi_read(BIOSIGRP_CXUPS, BIOSIOFFS_CXUPS_GETCHARGINGCURRENT,
-		   &pbi->charging_current_mA, sizeof(pbi->charging_current_mA));
+	const struct bbapi_xfer xfers[] = {
+		BBAPI_XFER_READ(BIOSIGRP_CXPWRSUPP, BIOSIOFFS_CXPWRSUPP_GETTEMP,
+				&pbi->temp_C, sizeof(pbi->temp_C)),
+		BBAPI_XFER_READ(BIOSIGRP_CXUPS, BIOSIOFFS_CXUPS_GETPOWERSTATUS,
+				&pbi->power_status, sizeof(pbi->power_status)),
+		BBAPI_XFER_READ(BIOSIGRP_CXUPS, BIOSIOFFS_CXUPS_GETBATTERYPRESENT,
+				&pbi->battery_present, sizeof(pbi->battery_present)),
+		BBAPI_XFER_READ(BIOSIGRP_CXUPS, BIOSIOFFS_CXUPS_GETBATTERYCAPACITY,
+				&pbi->capacity_percent, sizeof(pbi->capacity_percent)),
+		BBAPI_XFER_READ(BIOSIGRP_CXUPS, BIOSIOFFS_CXUPS_GETBATTERYRUNTIME,
+				&pbi->battery_runtime_s, sizeof(pbi->battery_runtime_s)),
+		BBAPI_XFER_READ(BIOSIGRP_CXUPS, BIOSIOFFS_CXUPS_GETCHARGINGCURRENT,
+				&pbi->charging_current_mA, sizeof(pbi->charging_current_mA)),
+	};
+
+	BUILD_BUG_ON(sizeof(xfers) != sizeof(pbi->xfers));
+	memcpy(pbi->xfers, xfers, sizeof(xfers));
 }
 
-static void bbapi_power_monitor(struct work_struct *work)
+static void bbapi_power_monitor(struct bbapi_poll *poll)
 {
-	struct bbapi_cx2100_info *pbi = container_of(work,
+	struct bbapi_cx2100_info *pbi = container_of(poll,
 						     struct bbapi_cx2100_info,
-						     monitor.work);
+						     monitor);
 
-	bbapi_cx2100_read_status(pbi);
 	if (pbi->psy) {
 		power_supply_changed(pbi->psy);
 	}
-	queue_delayed_work(pbi->monitor_wqueue, &pbi->monitor, HZ * 5);
 }
 
 static enum power_supply_property cx2100_0904_props[] = {
@@ -158,20 +163,14 @@ static const struct power_supply_desc cx2100_0904_desc = {
 #define cx2100_read(offset, buffer) \
 	bbapi_read(BIOSIGRP_CXPWRSUPP, offset, &buffer, sizeof(buffer))
 
-static int init_workqueue(struct bbapi_cx2100_info *pbi, struct device *parent)
+static int init_monitor(struct bbapi_cx2100_info *pbi)
 {
-	INIT_DELAYED_WORK(&pbi->monitor, bbapi_power_monitor);
-	pbi->monitor_wqueue = create_singlethread_workqueue(dev_name(parent));
-	if (!pbi->monitor_wqueue) {
-		dev_err(parent, "wqueue init failed\n");
-		return -ESRCH;
-	}
-
-	if (!queue_delayed_work(pbi->monitor_wqueue, &pbi->monitor, HZ * 1)) {
-		destroy_workqueue(pbi->monitor_wqueue);
-		return -ESRCH;
-	}
-	return 0;
+	pbi->monitor.xfers = pbi->xfers;
+	pbi->monitor.num = ARRAY_SIZE(pbi->xfers);
+	pbi->monitor.period_ms = MONITOR_PERIOD_MS;
+	pbi->monitor.slack_ms = MONITOR_SLACK_MS;
+	pbi->monitor.complete = bbapi_power_monitor;
+	return bbapi_poll_register(&pbi->monitor);
 }
 
 static int init_cx2100_09x4(struct bbapi_cx2100_info *pbi,
@@ -186,13 +185,16 @@ static int init_cx2100_09x4(struct bbapi_cx2100_info *pbi,
 
 	pbi->manufacturer = "Beckhoff Automation";
 
+	bbapi_cx2100_init_xfers(pbi);
+	bbapi_rw_multi(pbi->xfers, ARRAY_SIZE(pbi->xfers));
+
 	psy_cfg.drv_data = pbi;
 	pbi->psy = power_supply_register(parent, desc, &psy_cfg);
 	if (IS_ERR(pbi->psy)) {
 		dev_err(parent, "failed to register power supply\n");
 		return PTR_ERR(pbi->psy);
 	}
-	return init_workqueue(pbi, parent);
+	return init_monitor(pbi);
 }
 
 static int bbapi_power_init(struct bbapi_cx2100_info *pbi,
@@ -245,8 +247,7 @@ static int bbapi_power_remove(struct platform_device *pdev)
 	struct bbapi_cx2100_info *pbi = platform_get_drvdata(pdev);
 
 	if (pbi->psy) {
-		cancel_delayed_work_sync(&pbi->monitor);
-		destroy_workqueue(pbi->monitor_wqueue);
+		bbapi_poll_unregister(&pbi->monitor);
 		power_supply_unregister(pbi->psy);
 	}
 	kfree(pbi);
@@ -0,0 +1,102 @@
+#!/bin/bash
+# Attribute perf samples inside the BIOS shadow of bbapi to offsets.
+#
+# The BIOS is a flat binary copied into kernel memory, so perf can't
+# resolve samples taken there to symbols. This script reads the location
+# of the copy from debugfs and bins the samples of a perf.data file by
+# their offset from the start of the copy (the shadow base). The report
+# also shows the distance of each bin to the BIOS entry point.
+#
+# Copyright (C) 2026  Beckhoff Automation GmbH
+#
+# Permission is hereby granted, free of charge, to any person obtaining
+# a copy of this software and associated documentation files
+# (the "Software"), to deal in the Software without restriction,
+# including without limitation the rights to use, copy, modify, merge,
+# publish, distribute, sublicense, and/or sell copies of the Software,
+# and to permit persons to whom the Software is furnished to do so,
+# subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be
+# included in all copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+# EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+# MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+# IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+# CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+# TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+# SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+debugfs=${BBAPI_DEBUGFS:-/sys/kernel/debug/bbapi}
+
+if [ $# -lt 1 ] || [ $# -gt 2 ]; then
+	echo -e "Usage:\n $0 <perf.data> [<bin_size>]\n\nexample:\n $0 perf.data 256\n"
+	echo -e "Record with the module loaded, e.g.:"
+	echo -e " perf record -a -e cycles:k -- sleep 10\n"
+	exit 64
+fi
+
+perf_data=$1
+bin_size=${2:-256}
+
+if [ ! -r "${debugfs}/shadow_info" ]; then
+	echo "${debugfs}/shadow_info not readable, is debugfs mounted and bbapi loaded?" >&2
+	exit 1
+fi
+
+base=$(awk '$1 == "base:" { print $2 }' "${debugfs}/shadow_info")
+size=$(awk '$1 == "size:" { print $2 }' "${debugfs}/shadow_info")
+entry=$(awk '$1 == "entry:" { print $2 }' "${debugfs}/shadow_info")
+
+# keep the image next to the report, so the hot bins can be disassembled
+cp "${debugfs}/shadow" bbapi_shadow.bin
+
+perf script -i "${perf_data}" -F ip 2>/dev/null | awk \
+	-v base="${base}" -v size="${size}" -v entry="${entry}" -v bin="${bin_size}" '
+# Split 64 bit addresses into two 32 bit halves, awk numbers are doubles.
+function hexval(s,    i, v) {
+	v = 0
+	s = tolower(s)
+	for (i = 1; i <= length(s); i++)
+		v = v * 16 + index("0123456789abcdef", substr(s, i, 1)) - 1
+	return v
+}
+function split64(s, parts) {
+	sub(/^0x/, "", s)
+	s = sprintf("%16s", s)
+	gsub(/ /, "0", s)
+	parts["hi"] = hexval(substr(s, 1, 8))
+	parts["lo"] = hexval(substr(s, 9, 8))
+}
+function offset(s,    a) {
+	split64(s, a)
+	return (a["hi"] - b["hi"]) * 4294967296 + (a["lo"] - b["lo"])
+}
+BEGIN {
+	split64(base, b)
+	limit = hexval(substr(size, 3))
+	start = offset(entry)
+}
+{
+	total++
+	off = offset($1)
+	if (off < 0 || off >= limit)
+		next
+	inside++
+	hist[int(off / bin)]++
+}
+END {
+	printf("%d of %d samples inside the BIOS shadow (base %s, size %s)\n",
+	       inside, total, base, size)
+	if (!inside)
+		exit
+	printf("%12s %12s %8s %7s\n", "offset", "entry+", "samples", "%")
+	for (i in hist)
+		printf("0x%010x %+12d %8d %6.2f%%\n", i * bin, i * bin - start,
+		       hist[i], 100 * hist[i] / inside) | "sort -k3,3nr"
+}'
+
+echo
+echo "Disassemble a bin with:"
+echo " objdump -D -b binary -m i386:x86-64 --adjust-vma=${base} bbapi_shadow.bin"
@@ -7,8 +7,12 @@
 
 #include <linux/module.h>
 #include <linux/gpio.h>
+#include <linux/hrtimer.h>
 #include <linux/slab.h>
 #include <linux/platform_device.h>
+#include <linux/sched/isolation.h>
+#include <linux/smp.h>
+#include <linux/version.h>
 
 #include "../api.h"
 #include "../TcBaDevDef.h"
@@ -16,9 +20,21 @@
 #define DRV_VERSION      "0.2"
 #define DRV_DESCRIPTION  "Beckhoff BIOS API 1-second UPS driver"
 
+static unsigned int pwrfail_poll_ms = 10;
+module_param(pwrfail_poll_ms, uint, 0444);
+MODULE_PARM_DESC(pwrfail_poll_ms,
+		 "Interval in ms to sample the power fail signal for quiescing the BIOS API, 0 to disable");
+
+static unsigned int pwrfail_slack_ms = 5;
+module_param(pwrfail_slack_ms, uint, 0444);
+MODULE_PARM_DESC(pwrfail_slack_ms,
+		 "Time in ms a power fail sample may be delayed to share a wakeup with other timers");
+
 struct bbapi_sups_info {
 	struct gpio_chip gpio_chip;
 	struct Bapi_GpioInfoEx gpio_info;
+	struct hrtimer pwrfail_timer;
+	bool pwrfail;
 };
 
 #define sups_read(offset, buffer) \
@@ -32,6 +48,89 @@ static int sups_gpio_get(struct gpio_chip *chip, unsigned nr)
 	return inl(pbi->gpio_info.address) & pbi->gpio_info.bitmask;
 }
 
+/**
+ * sups_pwrfail_poll() - quiesce the BIOS API while power fail is asserted
+ *
+ * The S-UPS bridges roughly one second, only critical BIOS calls should
+ * be executed within that time. The BIOS reports only the I/O port of the
+ * power fail signal, no interrupt, so we have to sample it.
+ */
+static enum hrtimer_restart sups_pwrfail_poll(struct hrtimer *timer)
+{
+	struct bbapi_sups_info *pbi =
+	    container_of(timer, struct bbapi_sups_info, pwrfail_timer);
+	const bool pwrfail = inl(pbi->gpio_info.address) & pbi->gpio_info.bitmask;
+
+	if (pwrfail != pbi->pwrfail) {
+		pbi->pwrfail = pwrfail;
+		bbapi_quiesce(pwrfail);
+	}
+	hrtimer_forward_now(timer, ms_to_ktime(pwrfail_poll_ms));
+	return HRTIMER_RESTART;
+}
+
+/**
+ * sups_pwrfail_arm() - start the power fail timer on the current CPU
+ *
+ * The timer is pinned and rearms itself, so it keeps running on the CPU
+ * it was started on. hrtimer_forward_now() moves the soft and the hard
+ * expiry alike, so the slack applies to every period.
+ */
+static void sups_pwrfail_arm(void *info)
+{
+	struct bbapi_sups_info *pbi = info;
+
+	hrtimer_start_range_ns(&pbi->pwrfail_timer,
+			       ms_to_ktime(pwrfail_poll_ms),
+			       (u64)pwrfail_slack_ms * NSEC_PER_MSEC,
+			       HRTIMER_MODE_REL_PINNED);
+}
+
+/**
+ * sups_pwrfail_cpu() - CPU to run the power fail timer on
+ *
+ * Keep the periodic wakeups off CPUs isolated with nohz_full= or isolcpus=.
+ */
+static int sups_pwrfail_cpu(void)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 17, 0)
+	return housekeeping_any_cpu(HK_TYPE_TIMER);
+#else
+	return housekeeping_any_cpu(HK_FLAG_TIMER);
+#endif
+}
+
+static void sups_pwrfail_start(struct bbapi_sups_info *pbi)
+{
+	if (!pwrfail_poll_ms) {
+		return;
+	}
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 13, 0)
+	hrtimer_setup(&pbi->pwrfail_timer, sups_pwrfail_poll, CLOCK_MONOTONIC,
+		      HRTIMER_MODE_REL_PINNED);
+#else
+	hrtimer_init(&pbi->pwrfail_timer, CLOCK_MONOTONIC,
+		     HRTIMER_MODE_REL_PINNED);
+	pbi->pwrfail_timer.function = sups_pwrfail_poll;
+#endif
+	if (smp_call_function_single(sups_pwrfail_cpu(), sups_pwrfail_arm,
+				     pbi, 1)) {
+		/* the CPU went offline meanwhile */
+		sups_pwrfail_arm(pbi);
+	}
+}
+
+static void sups_pwrfail_stop(struct bbapi_sups_info *pbi)
+{
+	if (!pwrfail_poll_ms) {
+		return;
+	}
+	hrtimer_cancel(&pbi->pwrfail_timer);
+	if (pbi->pwrfail) {
+		bbapi_quiesce(false);
+	}
+}
+
 static const char *sups_gpio_names[] = {
 	"sups_pwrfail",
 };
@@ -79,6 +178,7 @@ static int init_sups(struct bbapi_sups_info *pbi)
 	pr_info("registered %s as gpiochip%d with #%d GPIOs.\n",
 		pbi->gpio_chip.label, pbi->gpio_chip.base,
 		pbi->gpio_chip.ngpio);
+	sups_pwrfail_start(pbi);
 	return 0;
 }
 
@@ -105,6 +205,7 @@ static int bbapi_sups_remove(struct platform_device *pdev)
 	struct bbapi_sups_info *pbi = platform_get_drvdata(pdev);
 
 	if (pbi->gpio_info.address) {
+		sups_pwrfail_stop(pbi);
 		gpiochip_remove(&pbi->gpio_chip);
 		release_region(pbi->gpio_info.address, pbi->gpio_info.length);
 	}
@@ -8,7 +8,9 @@
 #include <stdio.h>
 #include <sys/ioctl.h>
 #include <unistd.h>
+#include <sys/mman.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <string.h>
 #include <fcntl.h>
 #include <stdint.h>
@@ -301,6 +303,79 @@ struct TestBBAPI : fructose::test_base<TestBBAPI>
 		CHECK_CLASS("BIOS API %s\n", BIOSIOFFS_GENERAL_VERSION, CONFIG_GENERAL_VERSION, BADEVICE_VERSION);
 	}
 
+	void test_PreparedRequest(const std::string& test_name)
+	{
+		const int fd = open(FILE_PATH, O_RDWR);
+		fructose_assert_ne(-1, fd);
+
+		uint8_t platform = 0xff;
+		uint32_t bytesReturned = 0;
+		struct bbapi_struct data {BIOSIGRP_GENERAL, BIOSIOFFS_GENERAL_GETPLATFORMINFO, NULL, 0, &platform, sizeof(platform), &bytesReturned};
+		const int handle = ioctl(fd, BBAPI_CMD_PREPARE, &data);
+		fructose_assert(handle > 0);
+
+		for (int i = 0; i < 3; ++i) {
+			platform = 0xff;
+			fructose_assert_eq(0, ioctl(fd, BBAPI_CMD_EXECUTE, handle));
+			fructose_assert_eq(CONFIG_GENERAL_PLATFORM, platform);
+			fructose_assert_eq(sizeof(platform), bytesReturned);
+		}
+
+		const uint32_t handles[] {(uint32_t)handle, (uint32_t)handle};
+		struct bbapi_handle_list list {2, 0, handles};
+		platform = 0xff;
+		fructose_assert_eq(0, ioctl(fd, BBAPI_CMD_EXECUTE_LIST, &list));
+		fructose_assert_eq(CONFIG_GENERAL_PLATFORM, platform);
+
+		fructose_assert_eq(0, ioctl(fd, BBAPI_CMD_RELEASE, handle));
+		fructose_assert_eq(-1, ioctl(fd, BBAPI_CMD_EXECUTE, handle));
+		fructose_assert_eq(ENOENT, errno);
+		close(fd);
+	}
+
+	void test_InlinePayload(const std::string& test_name)
+	{
+		const int fd = open(FILE_PATH, O_RDWR);
+		fructose_assert_ne(-1, fd);
+
+		struct bbapi_struct_v2 req {};
+		req.nIndexGroup = BIOSIGRP_GENERAL;
+		req.nIndexOffset = BIOSIOFFS_GENERAL_GETPLATFORMINFO;
+		req.nOutBufferSize = sizeof(uint8_t);
+		req.data[0] = 0xff;
+		fructose_assert_eq(0, ioctl(fd, BBAPI_CMD_V2, &req));
+		fructose_assert_eq(0u, req.nStatus);
+		fructose_assert_eq(sizeof(uint8_t), req.nBytesReturned);
+		fructose_assert_eq(CONFIG_GENERAL_PLATFORM, req.data[0]);
+
+		req.nFlags = 0xffffffff;
+		fructose_assert_eq(-1, ioctl(fd, BBAPI_CMD_V2, &req));
+		fructose_assert_eq(EINVAL, errno);
+		close(fd);
+	}
+
+	void test_BoundGroup(const std::string& test_name)
+	{
+		const int fd = open(FILE_PATH, O_RDWR);
+		fructose_assert_ne(-1, fd);
+
+		uint8_t platform = 0xff;
+		fructose_assert_eq(-1, pread(fd, &platform, sizeof(platform), BIOSIOFFS_GENERAL_GETPLATFORMINFO));
+		fructose_assert_eq(ENXIO, errno);
+
+		fructose_assert_eq(0, ioctl(fd, BBAPI_CMD_BIND, BIOSIGRP_GENERAL));
+		fructose_assert_eq((ssize_t)sizeof(platform), pread(fd, &platform, sizeof(platform), BIOSIOFFS_GENERAL_GETPLATFORMINFO));
+		fructose_assert_eq(CONFIG_GENERAL_PLATFORM, platform);
+
+		// adjacent IndexOffsets: GETBOARDINFO, GETPLATFORMINFO
+		BADEVICE_MBINFO info;
+		platform = 0xff;
+		struct iovec iov[] {{&info, sizeof(info)}, {&platform, sizeof(platform)}};
+		fructose_assert_eq((ssize_t)(sizeof(info) + sizeof(platform)), preadv(fd, iov, 2, BIOSIOFFS_GENERAL_GETBOARDINFO));
+		fructose_assert_eq(CONFIG_GENERAL_PLATFORM, platform);
+		close(fd);
+	}
+
 	void test_LED(const std::string& test_name, const std::string& led_name, uint32_t offset)
 	{
 		const size_t num_colors = 4;
@@ -447,16 +522,9 @@ void RunAtPos(size_t pos)
 		return;
 	}
 
-	/** move cursor to our position */
-	for (size_t i = 0; i <= pos; ++i) {
-		static const char tab = '\t';
-		write(fd, &tab, 1);
-	}
-
-	/** print some characters */
+	/** print some characters, the file offset is row * 16 + column */
 	for (unsigned char c = '~'; c != ('/' + pos % 10); c--) {
-		const unsigned char replace_char[2] = {'\b', c};
-		write(fd, replace_char, sizeof(replace_char));
+		pwrite(fd, &c, sizeof(c), pos);
 		/** sleep a little to let the other threads work, too */
 		std::this_thread::sleep_for(std::chrono::milliseconds(50));
 	}
@@ -524,6 +592,59 @@ struct TestDisplay : fructose::test_base<TestDisplay>
 			t.join();
 		}
 		std::cout << " done." << std::endl;
+#endif
+	}
+
+	void test_Mirror(const std::string& test_name)
+	{
+#if CONFIG_CXPWRSUPP_DISABLED
+		pr_info("CX2100 text display test disabled\n");
+		return;
+#else
+		const int fd = open("/dev/cx_display", O_RDWR);
+		fructose_assert_ne(-1, fd);
+		static const std::string text("\fmirror\nme");
+		fructose_assert_eq((ssize_t)text.size(), write(fd, text.c_str(), text.size()));
+
+		char cells[32];
+		fructose_assert_eq((ssize_t)sizeof(cells), pread(fd, cells, sizeof(cells), 0));
+		fructose_assert(!memcmp("mirror          me              ", cells, sizeof(cells)));
+
+		char *const fb = (char *)mmap(NULL, 2 * 17, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		fructose_assert(MAP_FAILED != fb);
+		fructose_assert(!memcmp("mirror", fb, 6));
+		fructose_assert(!memcmp("me", fb + 17, 2));
+		memcpy(fb, "MIRROR", 6);
+		fructose_assert_eq(0, msync(fb, 2 * 17, MS_SYNC));
+		fructose_assert_eq((ssize_t)6, pread(fd, cells, 6, 0));
+		fructose_assert(!memcmp("MIRROR", cells, 6));
+		fructose_assert_eq(0, ioctl(fd, BBAPI_DISPLAY_FLUSH));
+		fructose_assert_eq(0, munmap(fb, 2 * 17));
+		fructose_assert_eq(0, close(fd));
+#endif
+	}
+
+	void test_Pwrite(const std::string& test_name)
+	{
+#if CONFIG_CXPWRSUPP_DISABLED
+		pr_info("CX2100 text display test disabled\n");
+		return;
+#else
+		const int fd = open("/dev/cx_display", O_RDWR);
+		fructose_assert_ne(-1, fd);
+		fructose_assert_eq((ssize_t)1, write(fd, "\f", 1));
+		fructose_assert_eq((ssize_t)4, pwrite(fd, "wrap", 4, 14));
+		fructose_assert_eq((off_t)0, lseek(fd, 0, SEEK_CUR));
+		fructose_assert_eq((off_t)16, lseek(fd, 16, SEEK_SET));
+		fructose_assert_eq((ssize_t)1, write(fd, "!", 1));
+		fructose_assert_eq((off_t)17, lseek(fd, 0, SEEK_CUR));
+		fructose_assert_eq((off_t)32, lseek(fd, 100, SEEK_SET));
+		fructose_assert_eq((off_t)31, lseek(fd, -1, SEEK_END));
+
+		char cells[32];
+		fructose_assert_eq((ssize_t)sizeof(cells), pread(fd, cells, sizeof(cells), 0));
+		fructose_assert(!memcmp("              wr!p              ", cells, sizeof(cells)));
+		fructose_assert_eq(0, close(fd));
 #endif
 	}
 };
@@ -685,10 +806,15 @@ int main(int argc, char *argv[])
 	TestDisplay displayTest;
 	displayTest.add_test("test_Simple", &TestDisplay::test_Simple);
 	displayTest.add_test("test_SMP", &TestDisplay::test_SMP);
+	displayTest.add_test("test_Mirror", &TestDisplay::test_Mirror);
+	displayTest.add_test("test_Pwrite", &TestDisplay::test_Pwrite);
 	failures += displayTest.run(argc, argv);
 
 	TestBBAPI bbapiTest;
 	bbapiTest.add_test("test_General", &TestBBAPI::test_General);
+	bbapiTest.add_test("test_PreparedRequest", &TestBBAPI::test_PreparedRequest);
+	bbapiTest.add_test("test_InlinePayload", &TestBBAPI::test_InlinePayload);
+	bbapiTest.add_test("test_BoundGroup", &TestBBAPI::test_BoundGroup);
 	bbapiTest.add_test("test_PwrCtrl", &TestBBAPI::test_PwrCtrl);
 	bbapiTest.add_test("test_SUPS", &TestBBAPI::test_SUPS);
 	bbapiTest.add_test("test_System", &TestBBAPI::test_System);